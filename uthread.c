@@ -6,11 +6,166 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <semaphore.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <time.h>
 #include <ucontext.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#else
+#include <poll.h>
+#endif
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 #include "uthread.h"
 
+// The lock is picked at compile time by UTHREAD_LOCKING. Under the
+// many-to-one mapping only one kernel thread ever touches the
+// scheduler, so by default there is no lock at all. A many-to-many
+// build has to use the spinlock; the semaphore is what the library
+// always used before and is kept for comparison.
+#define UTHREAD_LOCK_NONE 0
+#define UTHREAD_LOCK_SPIN 1
+#define UTHREAD_LOCK_SEM 2
+
+#ifndef UTHREAD_LOCKING
+#define UTHREAD_LOCKING UTHREAD_LOCK_NONE
+#endif
+
+#if UTHREAD_LOCKING == UTHREAD_LOCK_SEM
+#include <semaphore.h>
+#endif
+
 #define STACK_SIZE 16384
+#define STACK_CLASSES 5
+#define STACK_PATTERN 0xa5a5a5a5a5a5a5a5ULL
+#define STACK_CANARY 0x5ca1ab1ec0ffee00ULL
+#define STACK_STATS_BUCKETS 64
+#define SHARED_STACK_SIZE (1024 * 1024)
+#define SHARED_STACK_MARGIN 512
+#define NAME_SIZE 32
+#define MAX_WORKERS 64
+#define DEQUE_CAPACITY 32
+#define STEAL_MAX 128
+#define CHUNK_SIZE (1024 * 1024)
+#define CHUNK_HEADER 64
+#define MAX_NODES 64
+#define MPOL_BIND_NODE 2
+#define SPIN_NS 50000
+#define RUNNEXT_LIMIT 8
+#define RUNNEXT_GRACE_NS 3000
+#define SUPERVISE_US 1000
+#define SUPERVISE_TICKS 3
+#define LINGER_NS 1000000000ULL
+#define MAX_HELPERS 4
+#define PARK_BITS 8
+#define MUTEX_SPIN_NS 1000
+#define MUTEX_SPIN_MIN_NS 200
+#define MUTEX_SPIN_MAX_NS 20000
+#define MUTEX_SPIN_CHECK 32
+#define KEY_DESTRUCTOR_ROUNDS 4
+#define ARENA_SIZE (64 * 1024)
+#define ARENA_HEADER 16
+#define GROUP_SLAB 64
+
+
+/////////////////////////////////////////////////////////////////////
+//                         Locking policy                          //
+/////////////////////////////////////////////////////////////////////
+
+
+#if UTHREAD_LOCKING == UTHREAD_LOCK_SEM
+typedef sem_t lock_t;
+#else
+typedef int lock_t;
+#endif
+
+// Tells the CPU we are busy-waiting.
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Initializes an unlocked lock.
+static inline void lock_init(lock_t *lock)
+{
+#if UTHREAD_LOCKING == UTHREAD_LOCK_SEM
+    sem_init(lock, 0, 1);
+#else
+    *lock = 0;
+#endif
+}
+
+// Releases any resources held by the lock.
+static inline void lock_destroy(lock_t *lock)
+{
+#if UTHREAD_LOCKING == UTHREAD_LOCK_SEM
+    sem_destroy(lock);
+#else
+    (void) lock;
+#endif
+}
+
+// Acquires the lock. The spinlock only tries the atomic exchange when
+// a plain load says the lock is free, so waiters don't keep stealing
+// the cache line from the holder.
+static inline void lock_acquire(lock_t *lock)
+{
+#if UTHREAD_LOCKING == UTHREAD_LOCK_SPIN
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+        {
+            cpu_relax();
+        }
+    }
+#elif UTHREAD_LOCKING == UTHREAD_LOCK_SEM
+    sem_wait(lock);
+#else
+    (void) lock;
+#endif
+}
+
+// Releases the lock.
+static inline void lock_release(lock_t *lock)
+{
+#if UTHREAD_LOCKING == UTHREAD_LOCK_SPIN
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#elif UTHREAD_LOCKING == UTHREAD_LOCK_SEM
+    sem_post(lock);
+#else
+    (void) lock;
+#endif
+}
+
+// Acquires a wait queue lock. These are only held for a few
+// instructions, so they spin whatever the policy. They are taken even
+// with a single worker, since semaphores, latches, wait groups,
+// promises and cancellation may be released from kernel threads the
+// scheduler doesn't run on.
+static inline void waitq_acquire(int *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+    {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+        {
+            cpu_relax();
+        }
+    }
+}
+
+// Releases a wait queue lock.
+static inline void waitq_release(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
 
 
 /////////////////////////////////////////////////////////////////////
@@ -18,232 +173,4996 @@
 /////////////////////////////////////////////////////////////////////
 
 
-// The best approach would probably be to use a heap-based priority
-// queue, but since there don't appear to be restrictions, I will
-// use a simple circular, doubly-linked list.
+// Every worker kernel thread has a run queue per priority level, and
+// each level is a Chase-Lev work-stealing deque. The owning worker
+// pushes at the bottom, and both it and thieves take from the top, so
+// threads of the same priority still run oldest first, as they did
+// when there was a single queue.
+
+// Aggregate off-CPU time for every thread sharing a name.
+typedef struct name_stats
+{
+    char name[NAME_SIZE];                               // Thread name
+    unsigned long long offcpu[UTHREAD_WAIT_REASONS];    // Nanoseconds per wait reason
+    struct name_stats *next;                            // Next name in the list
+} name_stats_t;
+
+struct worker;
+
+// State only some threads need: names, arenas, cleanup handlers,
+// group membership, a shared stack's saved copy and blocking calls. It
+// is allocated the first time a thread needs any of it, or with the
+// thread if it runs on the shared stack, and keeps the node every
+// thread has small. Group members have theirs in their group's slab.
+typedef struct thread_extra
+{
+    name_stats_t *stats;    // Off-CPU totals for the thread's name, or NULL if unnamed
+    void *arenas;           // Arena blocks of a UTHREAD_ARENA thread, newest first
+    char *arena_next;       // Next free byte of the newest arena block
+    size_t arena_left;      // Bytes left in the newest arena block
+    struct uthread_cleanup *cleanup;    // Newest cleanup handler
+    struct uthread_group *group;        // Group whose slab holds the node, or NULL
+    int (*group_fn)(void *);            // Function a group member runs
+    struct uthread *group_prev;         // Previous running member of the group
+    struct uthread *group_next;         // Next running member of the group
+    char *stack_sp;         // Lowest used shared stack address when switched away
+    char *saved_stack;      // Copy of the used shared stack while switched away
+    size_t saved_size;      // Bytes of shared stack in saved_stack
+    size_t saved_cap;       // Bytes allocated for saved_stack
+    void (*blocking)(void *);   // Blocking call to run on a helper kernel thread
+    void *blocking_arg;     // Argument passed to the blocking call
+} thread_extra_t;
 
 // Represents a uthread consisting of a priority, function, context,
-// and links to other threads in the queue.
-typedef struct node
+// and a link to other threads in a queue.
+struct uthread
 {
-    int priority;           // Thread priority
+    int priority;           // Thread priority, raised while it holds a mutex others wait on
+    int base_priority;      // Priority the thread asked for
+    int queued;             // Whether an entry for the thread in a run queue may run it
+    int refs;               // One for the thread, plus one per surplus run queue entry
+    int flags;              // UTHREAD_* creation flags
+    int cancelled;          // CANCEL_* bits, 0 unless the thread has been asked to stop
+    struct uthread_mutex *pi_held;  // Held mutexes with waiters, which boost the thread
+    const void *park_addr;  // Address the thread is parked on in the parking lot
+    struct uthread_waitq *wait_queue;   // Queue of a cancellable wait the thread is in, else NULL
     void (*func)();         // Thread function code
-    ucontext_t *context;    // Thread context
-    struct node *next;      // Next thread in the queue
-    struct node *prev;      // Previous thread in the queue
-} uthread_t;
+    void (*task)(void *);   // Function code taking an argument, used if func is NULL
+    void *arg;              // Argument passed to the task function
+    ucontext_t *context;    // Thread context, or NULL until first dispatched
+    struct worker *home;    // Worker whose shared stack the thread runs on
+    char stackless;         // Whether the thread is a task on the dispatch loop's stack
+    unsigned char stack_class;  // Size class of the thread's block
+    char painted;           // Whether the thread's stack was painted
+    signed char pin_level;  // Level of home's pinned queue holding the thread, or -1
+    int wait_reason;        // Why the thread is off-CPU, or -1 if it isn't waiting
+    unsigned long long wait_start;  // When the current wait began, in nanoseconds
+    thread_extra_t *extra;  // State only some threads need, or NULL until one does
+    struct uthread *next;   // Next thread in an injection, pinned, helper or wait queue
+    void *specific[UTHREAD_KEYS_MAX];   // Value of each thread-local key
+};
 
-// Represents a queue of threads consisting of linked uthreads, a
-// pointer to the head of the queue, the queue size, and the
-// currently running uthread, which is no longer in the queue.
-typedef struct queue
+// The array behind a deque. Rings only ever grow, and a ring that has
+// been replaced is kept until the process ends since a thief may still
+// be reading from it.
+typedef struct ring
 {
-    uthread_t *head;    // Head of the queue (get to the tail by following one link forward)
-    int size;           // Queue size
-    uthread_t *active;  // The currently running thread
-} queue_t;
+    long mask;              // Capacity minus one
+    struct ring *retired;   // The ring this one replaced
+    uthread_t *items[];     // Threads, indexed modulo the capacity
+} ring_t;
 
+// A Chase-Lev deque of threads. top and bottom only ever increase;
+// the threads between them are in the deque.
+typedef struct deque
+{
+    long top;       // Index of the oldest thread, advanced by CAS
+    long bottom;    // Index after the newest thread, written by the owner
+    ring_t *ring;   // Current ring
+} deque_t;
 
-// Adds the uthread to the queue.
-static void add(queue_t **queue, uthread_t *item)
+// Allocates a ring with the given capacity, which must be a power of
+// two. Returns NULL if it couldn't be allocated.
+static ring_t* ring_alloc(long capacity)
 {
-    if ((*queue)->size == 0)
+    ring_t *ring = (ring_t *) malloc(sizeof(ring_t) + capacity * sizeof(uthread_t *));
+    if (ring)
     {
-        // Queue is empty
-        (*queue)->head = item;
-        item->next = item;
-        item->prev = item;
+        ring->mask = capacity - 1;
+        ring->retired = NULL;
     }
-    else if ((*queue)->size == 1)
+    return ring;
+}
+
+// Initializes an empty deque. This function returns 0 if succeeds, or
+// -1 otherwise.
+static int deque_init(deque_t *deque)
+{
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->ring = ring_alloc(DEQUE_CAPACITY);
+    return deque->ring ? 0 : -1;
+}
+
+// Returns whether the deque looks empty. This is only a hint when
+// other workers may be pushing or taking.
+static int deque_empty(deque_t *deque)
+{
+    return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >=
+        __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+// Moves the deque to a ring twice the size. Only the owner may call
+// this.
+static ring_t* deque_grow(deque_t *deque, long top, long bottom)
+{
+    ring_t *ring = deque->ring;
+    ring_t *grown = ring_alloc(2 * (ring->mask + 1));
+    if (!grown)
     {
-        // Single item in queue
-        item->next = (*queue)->head;
-        item->prev = (*queue)->head;
-        (*queue)->head->next = item;
-        (*queue)->head->prev = item;
+        fprintf(stderr, "uthread: unable to grow a run queue\n");
+        exit(1);
     }
-    else
+    for (long i = top; i < bottom; i++)
     {
-        // More than 1 items in queue
-        (*queue)->head->next->prev = item;
-        item->next = (*queue)->head->next;
-        item->prev = (*queue)->head;
-        (*queue)->head->next = item;
+        grown->items[i & grown->mask] = ring->items[i & ring->mask];
     }
-    (*queue)->size++;
+    grown->retired = ring;
+    __atomic_store_n(&deque->ring, grown, __ATOMIC_RELEASE);
+    return grown;
 }
 
-// Retrieves the next highest priority thread and removes it from the
-// queue. If there are multiple threads with the same priority, it
-// will take the oldest of them.
-static uthread_t* get_priority_thread(queue_t **queue)
+// Adds the uthread to the bottom of the deque. Only the owner may call
+// this.
+static void deque_push(deque_t *deque, uthread_t *item)
 {
-    if ((*queue)->size == 0)
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    ring_t *ring = deque->ring;
+    if (bottom - top > ring->mask)
     {
-        // Empty queue
-        return NULL;
+        ring = deque_grow(deque, top, bottom);
     }
-    
-    if ((*queue)->size == 1)
+    __atomic_store_n(&ring->items[bottom & ring->mask], item, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+}
+
+// Takes the oldest uthread from the top of the deque, or returns NULL
+// if it is empty. Any worker may call this.
+static uthread_t* deque_take(deque_t *deque)
+{
+    for (;;)
     {
-        // Single item in queue
-        uthread_t *curr = (*queue)->head;
-        (*queue)->head = NULL;
-        (*queue)->size = 0;
-        return curr;
+        long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+        long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+        if (top >= bottom)
+        {
+            return NULL;
+        }
+
+        ring_t *ring = __atomic_load_n(&deque->ring, __ATOMIC_ACQUIRE);
+        uthread_t *item = __atomic_load_n(&ring->items[top & ring->mask], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            return item;
+        }
     }
-    
-    // Find the node with the highest priority
-    uthread_t *curr = (*queue)->head;
-    uthread_t *priority_node = curr;
-    int highest_priority = curr->priority;
-    while (curr->prev != (*queue)->head)
+}
+
+// Takes the older half of the victim's threads in one CAS and pushes
+// them onto the thief's deque, which the calling worker must own.
+// Returns the number of threads stolen.
+static int deque_steal_half(deque_t *victim, deque_t *thief)
+{
+    uthread_t *stolen[STEAL_MAX];
+    long count;
+    for (;;)
     {
-        curr = curr->prev;
-        if (curr->priority < highest_priority)
+        long top = __atomic_load_n(&victim->top, __ATOMIC_ACQUIRE);
+        long bottom = __atomic_load_n(&victim->bottom, __ATOMIC_ACQUIRE);
+        if (top >= bottom)
+        {
+            return 0;
+        }
+
+        count = bottom - top - (bottom - top) / 2;
+        if (count > STEAL_MAX)
+        {
+            count = STEAL_MAX;
+        }
+        ring_t *ring = __atomic_load_n(&victim->ring, __ATOMIC_ACQUIRE);
+        for (long i = 0; i < count; i++)
+        {
+            stolen[i] = __atomic_load_n(&ring->items[(top + i) & ring->mask], __ATOMIC_RELAXED);
+        }
+        if (__atomic_compare_exchange_n(&victim->top, &top, top + count, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
         {
-            priority_node = curr;
-            highest_priority = curr->priority;
+            break;
         }
     }
-    
-    // Unlink the node
-    if (priority_node == (*queue)->head)
+
+    for (long i = 0; i < count; i++)
+    {
+        deque_push(thief, stolen[i]);
+    }
+    return (int) count;
+}
+
+// Frees the deque's rings.
+static void cleanup_deque(deque_t *deque)
+{
+    ring_t *ring = deque->ring;
+    while (ring)
+    {
+        ring_t *retired = ring->retired;
+        free(ring);
+        ring = retired;
+    }
+}
+
+// A FIFO list of threads, linked through their next pointers.
+typedef struct list
+{
+    uthread_t *head;    // Oldest thread
+    uthread_t *tail;    // Newest thread
+} list_t;
+
+// Adds the uthread to the end of the list.
+static void list_push(list_t *list, uthread_t *item)
+{
+    item->next = NULL;
+    if (list->tail)
+    {
+        list->tail->next = item;
+    }
+    else
+    {
+        list->head = item;
+    }
+    list->tail = item;
+}
+
+// Removes the oldest uthread from the list, or returns NULL if it is
+// empty.
+static uthread_t* list_pop(list_t *list)
+{
+    uthread_t *item = list->head;
+    if (item)
     {
-        (*queue)->head = priority_node->prev;
+        list->head = item->next;
+        if (!list->head)
+        {
+            list->tail = NULL;
+        }
     }
-    priority_node->prev->next = priority_node->next;
-    priority_node->next->prev = priority_node->prev;
-    (*queue)->size--;
-    
-    return priority_node;
+    return item;
 }
 
-// Frees the memory associated with the queue.
-static void cleanup_queue(queue_t *queue)
+// Removes the uthread from the list, which must hold it.
+static void list_remove(list_t *list, uthread_t *item)
 {
-    uthread_t *curr = queue->head;
-    while (curr)
+    uthread_t *prev = NULL;
+    uthread_t *curr = list->head;
+    while (curr != item)
     {
-        uthread_t *to_free = curr;
+        prev = curr;
         curr = curr->next;
-        free(to_free);
     }
-    free(queue->active);
-    free(queue);
+    if (prev)
+    {
+        prev->next = item->next;
+    }
+    else
+    {
+        list->head = item->next;
+    }
+    if (list->tail == item)
+    {
+        list->tail = prev;
+    }
+}
+
+// A wait-free multi-producer, single-consumer queue of threads, after
+// Dmitry Vyukov's intrusive MPSC queue. Producers link threads through
+// their next pointer and only ever swap the tail, so pushing costs one
+// atomic exchange. A stub node means neither end needs a lock.
+typedef struct mpsc
+{
+    uthread_t *head;    // Consumer end of the queue
+    uthread_t *tail;    // Producer end of the queue
+    uthread_t stub;     // Placeholder keeping the queue non-empty
+} mpsc_t;
+
+// Initializes an empty queue.
+static void mpsc_init(mpsc_t *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+// Adds the uthread to the queue. This may be called from any kernel
+// thread.
+static void mpsc_push(mpsc_t *queue, uthread_t *item)
+{
+    __atomic_store_n(&item->next, NULL, __ATOMIC_RELAXED);
+    uthread_t *prev = __atomic_exchange_n(&queue->tail, item, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, item, __ATOMIC_RELEASE);
+}
+
+// Removes the oldest uthread from the queue, or returns NULL if it is
+// empty or a producer is midway through adding the next one. Only the
+// consumer may call this.
+static uthread_t* mpsc_pop(mpsc_t *queue)
+{
+    uthread_t *head = queue->head;
+    uthread_t *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (head == &queue->stub)
+    {
+        if (!next)
+        {
+            return NULL;
+        }
+        queue->head = next;
+        head = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next)
+    {
+        queue->head = next;
+        return head;
+    }
+
+    // The head is the last thread, so put the stub back behind it
+    // before taking it
+    if (head != __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    mpsc_push(queue, &queue->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        queue->head = next;
+        return head;
+    }
+    return NULL;
+}
+
+// Returns whether the queue looks empty, counting threads a producer
+// is still adding. Any kernel thread may call this; once the consumer
+// has taken the last thread the stub is the tail again.
+static int mpsc_empty(mpsc_t *queue)
+{
+    return __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) == &queue->stub;
 }
 
 
 /////////////////////////////////////////////////////////////////////
-//                     Library implementation                      //
+//                    Workers and the scheduler                    //
 /////////////////////////////////////////////////////////////////////
 
 
-// Locking isn't actually necessary since only a single thread will
-// be accessing the thread queue due to the many-to-one mapping, but
-// I will use a sempahore in case we want to use a different mapping
-// scheme, like many-to-many, in the future.
-sem_t lock;
-queue_t *thread_queue;
+// Which priority levels of a worker's deques have threads in them,
+// published for thieves. It sits on a cache line of its own so that
+// thieves polling it don't slow down the owner's other fields. Only the
+// owner pushes to its deques, so only the owner clears a bit, when it
+// finds the level empty; a set bit may be stale once thieves have
+// emptied the level.
+typedef struct summary
+{
+    unsigned ready;     // Bit per level with ready threads
+} __attribute__((aligned(64))) summary_t;
 
-// This function is called before any other uthread library
-// functions can be called. It initializes the uthread system.
-void system_init()
+// A worker's steal victims, nearest first and ended by -1. A worker's
+// order is replaced whole when workers are added, and never changes
+// once published, so thieves read it without a lock. Replaced orders
+// are kept until the process ends, since a thief may still be reading
+// one; there are at most MAX_WORKERS of them per worker.
+typedef struct steal_order
+{
+    int ids[MAX_WORKERS];
+} steal_order_t;
+
+// A worker is a kernel thread running user-level threads. Everything
+// a worker touches on every switch is its own: its run queues, its
+// dispatch loop, its stack pool and its shared stack. Threads move
+// between workers only when an idle worker steals them.
+typedef struct worker
+{
+    int id;                     // Index in the scheduler's workers
+    pthread_t pthread;          // The worker's kernel thread
+    uthread_t *active;          // The currently running thread
+    unsigned long long dispatches;  // Times a thread has been made active
+    ucontext_t *sched_block;    // Dispatch loop context and stack
+    uthread_t *handoff;         // Thread the dispatch loop should run next
+    jmp_buf task_env;           // Where a running task goes when it exits
+    uthread_t *prev;            // Thread that just switched away
+    int prev_action;            // What finish_switch does with prev
+    int *park_lock;             // Wait queue lock to release once prev is parked
+    uthread_t *runnext;         // Woken thread to run before anything queued
+    int runnext_level;          // Level of runnext
+    unsigned long long runnext_at;  // When runnext was filled, in nanoseconds
+    int runnext_streak;         // Dispatches in a row taken from runnext
+    summary_t summary;          // Levels of runq with threads in them
+    deque_t runq[UTHREAD_PRIORITY_LEVELS];  // Ready threads per priority level
+    lock_t pin_lock;            // Protects pinned
+    list_t pinned[UTHREAD_PRIORITY_LEVELS]; // Ready threads only this worker can run
+    unsigned pinned_mask;       // Levels of pinned with threads in them
+    char *shared_stack;         // Stack for UTHREAD_SHARED_STACK threads
+    uthread_t *shared_owner;    // Thread whose frames are on the shared stack
+    void *free_blocks[STACK_CLASSES];   // Stack pool per size class
+    void *free_arenas;          // Pool of arena blocks
+    void *chunks;               // Memory mappings the stack pool is carved from
+    char *chunk;                // Unused part of the newest chunk
+    size_t chunk_left;          // Bytes left at chunk
+    int cpu;                    // CPU the worker is pinned to, or -1
+    int core;                   // Physical core of cpu
+    int package;                // Socket of cpu
+    int node;                   // NUMA node of cpu, or -1 if unknown
+    steal_order_t *steal_order; // Other workers, nearest first
+    unsigned long long steals;  // Threads this worker has stolen
+    unsigned long long remote_steals;   // Of those, from another NUMA node
+    int elastic;                // Whether the supervisor started the worker
+    int retired;                // Whether the worker's kernel thread has exited
+    int homed;                  // Shared stack threads pinned to the worker
+    ucontext_t exit_context;    // Where the worker's kernel thread retires to
+    unsigned long long seen_dispatches; // dispatches when the supervisor last looked
+    unsigned long long seen_at; // When the supervisor saw dispatches change
+    int stalled;                // Whether the supervisor has handed the worker off
+    int idle;                   // Whether the worker is parked
+#ifndef __linux__
+    int wake_fd[2];             // Read and write ends of the wakeup pipe
+#endif
+} worker_t;
+
+// What a thread that switched away leaves for whoever runs next on
+// its worker to do, now that its context has been saved. Until then
+// no other worker may see it.
+#define SWITCH_NONE 0       // Nothing to do
+#define SWITCH_READY 1      // Put prev back on a run queue
+#define SWITCH_EXIT 2       // Release prev's stack and node
+#define SWITCH_BLOCK 3      // Hand prev's blocking call to a helper
+#define SWITCH_PARK 4       // Release the lock of the wait queue prev joined
+
+// The scheduler, as seen by other kernel threads. They hand it threads
+// through the injection queue, which whichever worker gets to it first
+// drains into its own run queues. When there is nothing to run but
+// another kernel thread holds a reference, workers sleep rather than
+// ending the process.
+struct sched
 {
-    // Initialize thread queue
-    thread_queue = (queue_t *) malloc(sizeof(queue_t));
-    thread_queue->size = 0;
-    
-    // Initialize the semaphore
-    sem_init(&lock, 0, 1);
+    mpsc_t inject;          // Threads submitted by other kernel threads
+    int inject_busy;        // Whether a worker is draining inject
+    int refs;               // References held by other kernel threads
+    int live;               // Threads and tasks which haven't exited
+    int idle_workers;       // Workers parked or about to
+    int spinning;           // Workers polling for work before parking
+    int max_spinners;       // Most workers which may spin, or -1 for half
+    unsigned long long spin_ns; // How long a worker spins before parking
+    int nworkers;           // Number of workers ever set up
+    int running;            // Workers with a kernel thread
+    int peak_running;       // Most workers ever running at once
+    int max_workers;        // Most workers the supervisor may run, or 0
+    unsigned long long linger_ns;   // How long an elastic worker idles before retiring
+    unsigned long long started;     // Worker kernel threads started
+    unsigned long long retired;     // Worker kernel threads retired
+    unsigned long long stall_ns;    // How long a worker may run one thread, or 0
+    int stalled;            // Workers currently handed off as stalled
+    unsigned long long stalls;      // Times a worker has been handed off
+    int supervised;         // Whether the supervisor is running
+    int pin_workers;        // Whether workers are pinned to CPUs
+    int nodes;              // NUMA nodes the workers are pinned across
+    worker_t workers[MAX_WORKERS];
+};
+
+static struct sched scheduler;
+
+// Protects the name and stack stats tables.
+lock_t lock;
+
+// The worker running on this kernel thread.
+static __thread worker_t *current_worker;
+
+// Returns the worker running the caller. A thread can resume on a
+// different kernel thread from the one it switched away on, so this is
+// kept out of line to stop the compiler reusing the address of the
+// previous kernel thread's variable across a switch.
+static __attribute__((noinline)) worker_t* current()
+{
+    __asm__ volatile("" ::: "memory");
+    return current_worker;
 }
 
-// This function creates a new user-level thread which runs func(),
-// with priority number specified by argument priority. This function
-// returns 0 if succeeds, or -1 otherwise.
-int uthread_create(void func(), int priority)
+// Returns the current monotonic time in nanoseconds.
+static unsigned long long now_ns()
 {
-    // Allocate a node for the uthread
-    uthread_t *thread = (uthread_t *) malloc(sizeof(uthread_t));
-    if (!thread)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns the run queue level for a priority.
+static int level_of(int priority)
+{
+    if (priority < 0)
     {
-        return -1;
+        return 0;
     }
-    
-    thread->priority = priority;
-    thread->func = func;
-    
-    // Allocate the thread context
-    thread->context = (ucontext_t *) malloc(sizeof(ucontext_t));
-    if (!thread->context)
+    return priority < UTHREAD_PRIORITY_LEVELS ? priority : UTHREAD_PRIORITY_LEVELS - 1;
+}
+
+// Returns the most urgent level set in a summary bitmap, or
+// UTHREAD_PRIORITY_LEVELS if none are.
+static int first_level(unsigned levels)
+{
+    return levels ? __builtin_ctz(levels) : UTHREAD_PRIORITY_LEVELS;
+}
+
+// Pushes the thread onto the given level of the worker's own deques
+// and publishes the level in its summary.
+static void push_ready(worker_t *worker, int level, uthread_t *thread)
+{
+    deque_push(&worker->runq[level], thread);
+    if (!(worker->summary.ready & (1u << level)))
     {
-        return -1;
+        __atomic_or_fetch(&worker->summary.ready, 1u << level, __ATOMIC_RELEASE);
     }
-    
-    getcontext(thread->context);
-    thread->context->uc_stack.ss_sp = malloc(STACK_SIZE);
-    thread->context->uc_stack.ss_size = STACK_SIZE;
-    makecontext(thread->context, thread->func, 0);
-    
-    // Add the thread to the queue
-    sem_wait(&lock);
-    add(&thread_queue, thread);
-    sem_post(&lock);
-    
+}
+
+// A worker with nothing to run first spins, polling the run queues,
+// as long as fewer than max_spinners others already are. Otherwise,
+// or once it has spun for spin_ns, it parks until woken. Parked workers
+// wait on their idle flag with a futex, or read a pipe where there are
+// no futexes. New work only wakes a parked worker when nobody is
+// spinning, since a spinner will find it sooner; a spinner which finds
+// work and was the last one wakes a parked worker in its place, in
+// case more work follows.
+
+// Sets up the worker's means of parking. This function returns 0 if
+// succeeds, or -1 otherwise.
+static int wake_open(worker_t *worker)
+{
+#ifdef __linux__
+    (void) worker;
     return 0;
+#else
+    return pipe(worker->wake_fd);
+#endif
 }
 
-// The calling thread requests to yield the kernel thread that
-// it is currently running to one of other user threads which
-// has the highest priority level among the ready threads if
-// there is one or more other threads ready to run. If no
-// any other thread is ready to run, the calling thread should
-// proceed to run on the kernel thread. This function returns 0
-// if succeeds, or -1 otherwise.
-int uthread_yield(int priority)
+// Blocks the worker until its idle flag is cleared, or for at most
+// timeout_ns if that isn't 0. Returns 0 if the flag was cleared, or -1
+// if the timeout passed first.
+static int park(worker_t *worker, unsigned long long timeout_ns)
 {
-    sem_wait(&lock);
-    if (thread_queue->size == 0)
+    unsigned long long deadline = timeout_ns ? now_ns() + timeout_ns : 0;
+    while (__atomic_load_n(&worker->idle, __ATOMIC_ACQUIRE))
     {
-        sem_post(&lock);
-        return -1;
+        unsigned long long left = 0;
+        if (deadline)
+        {
+            unsigned long long now = now_ns();
+            if (now >= deadline)
+            {
+                return -1;
+            }
+            left = deadline - now;
+        }
+#ifdef __linux__
+        struct timespec ts = { (time_t) (left / 1000000000ULL), (long) (left % 1000000000ULL) };
+        syscall(SYS_futex, &worker->idle, FUTEX_WAIT_PRIVATE, 1, deadline ? &ts : NULL, NULL, 0);
+#else
+        struct pollfd fd = { worker->wake_fd[0], POLLIN, 0 };
+        if (poll(&fd, 1, deadline ? (int) ((left + 999999) / 1000000) : -1) > 0)
+        {
+            char value;
+            if (read(worker->wake_fd[0], &value, 1) < 0)
+            {
+                perror("uthread: park");
+            }
+        }
+#endif
     }
-    
-    thread_queue->active->priority = priority;
-    
-    // Find the next thread to run
-    uthread_t *thread = get_priority_thread(&thread_queue);
-    
-    // Add the yielding thread back into the queue and swap contexts
-    uthread_t *save = thread_queue->active;
-    add(&thread_queue, save);
-    thread_queue->active = thread;
-    sem_post(&lock);
-    swapcontext(save->context, thread->context);
-    
     return 0;
 }
 
-// The calling user-level thread ends its execution.
-void uthread_exit()
+// Wakes the worker if it is parked. Returns whether it was; only one
+// waker clears the flag for each park.
+static int wake_worker(worker_t *worker)
+{
+    if (!__atomic_exchange_n(&worker->idle, 0, __ATOMIC_SEQ_CST))
+    {
+        return 0;
+    }
+
+#ifdef __linux__
+    syscall(SYS_futex, &worker->idle, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    char value = 1;
+    if (write(worker->wake_fd[1], &value, 1) < 0)
+    {
+        perror("uthread: wake");
+    }
+#endif
+    return 1;
+}
+
+// Wakes one parked worker, if there is one, to come and steal.
+static void wake_one(worker_t *from);
+
+// Wakes a parked worker to steal work just queued by the given one,
+// unless a spinning worker will find it first.
+static void notify_idle(worker_t *worker)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&scheduler.idle_workers, __ATOMIC_RELAXED) > 0 &&
+        __atomic_load_n(&scheduler.spinning, __ATOMIC_RELAXED) == 0)
+    {
+        wake_one(worker);
+    }
+}
+
+// Wakes one parked worker, if there is one, to come and steal.
+static void wake_one(worker_t *from)
+{
+    int count = __atomic_load_n(&scheduler.nworkers, __ATOMIC_ACQUIRE);
+    for (int i = 1; i <= count; i++)
+    {
+        if (wake_worker(&scheduler.workers[(from->id + i) % count]))
+        {
+            return;
+        }
+    }
+}
+
+// Puts a ready thread on a run queue. Threads tied to a worker's
+// shared stack go to that worker's pinned queue; everything else goes
+// on the calling worker's own deque, where idle workers can steal it.
+static void enqueue(uthread_t *thread)
+{
+    __atomic_store_n(&thread->queued, 1, __ATOMIC_RELEASE);
+    worker_t *worker = current();
+    worker_t *home = thread->home;
+    if (home)
+    {
+        // The level is read under the lock, so that a boost racing
+        // with us either is seen here or finds the thread queued
+        lock_acquire(&home->pin_lock);
+        int level = level_of(__atomic_load_n(&thread->priority, __ATOMIC_SEQ_CST));
+        thread->pin_level = level;
+        list_push(&home->pinned[level], thread);
+        __atomic_or_fetch(&home->pinned_mask, 1u << level, __ATOMIC_SEQ_CST);
+        lock_release(&home->pin_lock);
+        if (home != worker)
+        {
+            wake_worker(home);
+        }
+        return;
+    }
+
+    push_ready(worker, level_of(thread->priority), thread);
+    notify_idle(worker);
+}
+
+// A thread woken by the one running, such as a consumer handed data by
+// a producer, goes in the worker's run-next slot if it is at least as
+// urgent as its waker. It then runs as soon as the waker switches
+// away, while the data is still in this CPU's cache, rather than after
+// everything queued at its level. Whatever was in the slot goes to the
+// back of its queue. So that two threads waking each other can't keep
+// the rest waiting, only RUNNEXT_LIMIT dispatches in a row come from
+// the slot, and it never jumps a more urgent queued thread. Thieves
+// leave the slot alone unless the worker hasn't got to it within
+// RUNNEXT_GRACE_NS.
+
+// Puts the thread in the worker's run-next slot, which the worker must
+// own, given that it became ready at the given time.
+static void put_runnext(worker_t *worker, uthread_t *thread, unsigned long long now)
+{
+    __atomic_store_n(&thread->queued, 1, __ATOMIC_RELEASE);
+    worker->runnext_level = level_of(thread->priority);
+    worker->runnext_at = now;
+    uthread_t *old = __atomic_exchange_n(&worker->runnext, thread, __ATOMIC_ACQ_REL);
+    if (old)
+    {
+        push_ready(worker, level_of(old->priority), old);
+    }
+    notify_idle(worker);
+}
+
+// Returns the level of the worker's run-next thread, or
+// UTHREAD_PRIORITY_LEVELS if the slot is empty.
+static int runnext_level(worker_t *worker)
+{
+    return __atomic_load_n(&worker->runnext, __ATOMIC_ACQUIRE) ?
+        worker->runnext_level : UTHREAD_PRIORITY_LEVELS;
+}
+
+// Takes the oldest pinned thread at the given level, or returns NULL.
+static uthread_t* take_pinned(worker_t *worker, int level)
 {
-    // Terminate when there are no more threads ready
-    sem_wait(&lock);
-    if (thread_queue->size == 0)
+    if (!(__atomic_load_n(&worker->pinned_mask, __ATOMIC_ACQUIRE) & (1u << level)))
     {
-        sem_post(&lock);
-        cleanup_queue(thread_queue);
-        sem_destroy(&lock);
-        exit(0);
+        return NULL;
+    }
+
+    lock_acquire(&worker->pin_lock);
+    uthread_t *thread = list_pop(&worker->pinned[level]);
+    if (thread)
+    {
+        thread->pin_level = -1;
+    }
+    if (!worker->pinned[level].head)
+    {
+        __atomic_and_fetch(&worker->pinned_mask, ~(1u << level), __ATOMIC_SEQ_CST);
+    }
+    lock_release(&worker->pin_lock);
+    return thread;
+}
+
+// Moves a pinned thread raised to the given level to the back of that
+// level's queue, if it is waiting in a less urgent one. The thread
+// stays in one queue at a time, since they link through its next
+// pointer.
+static void repin(worker_t *home, uthread_t *thread, int level)
+{
+    lock_acquire(&home->pin_lock);
+    int old = thread->pin_level;
+    if (old > level)
+    {
+        list_remove(&home->pinned[old], thread);
+        if (!home->pinned[old].head)
+        {
+            __atomic_and_fetch(&home->pinned_mask, ~(1u << old), __ATOMIC_SEQ_CST);
+        }
+        thread->pin_level = level;
+        list_push(&home->pinned[level], thread);
+        __atomic_or_fetch(&home->pinned_mask, 1u << level, __ATOMIC_SEQ_CST);
+    }
+    lock_release(&home->pin_lock);
+    if (old > level)
+    {
+        wake_worker(home);
     }
-    
-    // Retrieve a uthread from the queue
-    uthread_t *thread = get_priority_thread(&thread_queue);
-    
-    // Set the context and run the thread
-    free(thread_queue->active);
-    thread_queue->active = thread;
-    sem_post(&lock);
-    setcontext(thread->context);
 }
 
+// Returns the most urgent level with threads on the worker's own
+// queues, or UTHREAD_PRIORITY_LEVELS if there are none.
+static int local_level(worker_t *worker)
+{
+    return first_level(worker->summary.ready |
+                       __atomic_load_n(&worker->pinned_mask, __ATOMIC_ACQUIRE));
+}
+
+// Takes the worker's run-next thread, unless it has had its turn or a
+// more urgent thread is queued, in which case it moves to the back of
+// its queue. Returns NULL if the slot was empty or moved.
+static uthread_t* take_runnext(worker_t *worker)
+{
+    uthread_t *thread = NULL;
+    if (__atomic_load_n(&worker->runnext, __ATOMIC_RELAXED))
+    {
+        thread = __atomic_exchange_n(&worker->runnext, NULL, __ATOMIC_ACQ_REL);
+    }
+    if (!thread)
+    {
+        worker->runnext_streak = 0;
+        return NULL;
+    }
+
+    int level = level_of(thread->priority);
+    if (worker->runnext_streak < RUNNEXT_LIMIT && level <= local_level(worker))
+    {
+        worker->runnext_streak++;
+        return thread;
+    }
+    worker->runnext_streak = 0;
+    push_ready(worker, level, thread);
+    return NULL;
+}
+
+// Retrieves the next highest priority thread from the worker's run
+// queues and removes it. If there are multiple threads with the same
+// priority, it will take the oldest of them, unless a thread has just
+// been woken into the run-next slot.
+static uthread_t* get_priority_thread(worker_t *worker)
+{
+    uthread_t *thread = take_runnext(worker);
+    if (thread)
+    {
+        return thread;
+    }
+
+    unsigned levels = worker->summary.ready |
+        __atomic_load_n(&worker->pinned_mask, __ATOMIC_ACQUIRE);
+    while (levels)
+    {
+        int level = __builtin_ctz(levels);
+        levels &= levels - 1;
+
+        thread = deque_take(&worker->runq[level]);
+        if (!thread && (worker->summary.ready & (1u << level)))
+        {
+            // Thieves took the rest, and only we can refill it
+            __atomic_and_fetch(&worker->summary.ready, ~(1u << level), __ATOMIC_RELAXED);
+        }
+        if (!thread)
+        {
+            thread = take_pinned(worker, level);
+        }
+        if (thread)
+        {
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+// Moves every submitted thread onto the calling worker's run queues,
+// unless another worker is already doing so.
+static void drain_injected()
+{
+    if (mpsc_empty(&scheduler.inject) ||
+        __atomic_exchange_n(&scheduler.inject_busy, 1, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    uthread_t *thread;
+    while ((thread = mpsc_pop(&scheduler.inject)))
+    {
+        enqueue(thread);
+    }
+    __atomic_store_n(&scheduler.inject_busy, 0, __ATOMIC_RELEASE);
+}
+
+// Steals half the threads at the most urgent level any other worker
+// has that is more urgent than limit, and returns the oldest of them.
+// The other workers' summaries say which levels to try and who to try
+// them on, so victims holding the most urgent work are tried first.
+// Among those, the nearest victim is tried first.
+static uthread_t* steal_work(worker_t *worker, int limit)
+{
+    int count = __atomic_load_n(&scheduler.nworkers, __ATOMIC_ACQUIRE);
+    unsigned levels = 0;
+    for (int i = 1; i < count; i++)
+    {
+        levels |= __atomic_load_n(&scheduler.workers[(worker->id + i) % count].summary.ready,
+                                  __ATOMIC_ACQUIRE);
+    }
+    if (!levels)
+    {
+        return NULL;
+    }
+    if (limit < UTHREAD_PRIORITY_LEVELS)
+    {
+        levels &= (1u << limit) - 1;
+    }
+
+    steal_order_t *order = __atomic_load_n(&worker->steal_order, __ATOMIC_ACQUIRE);
+    while (levels)
+    {
+        int level = __builtin_ctz(levels);
+        levels &= levels - 1;
+        for (int i = 0; i < MAX_WORKERS - 1; i++)
+        {
+            int id = order->ids[i];
+            if (id < 0)
+            {
+                break;
+            }
+            if (id >= count)
+            {
+                continue;
+            }
+
+            worker_t *victim = &scheduler.workers[id];
+            if (!(__atomic_load_n(&victim->summary.ready, __ATOMIC_ACQUIRE) & (1u << level)))
+            {
+                continue;
+            }
+            int stolen = deque_steal_half(&victim->runq[level], &worker->runq[level]);
+            if (stolen > 0)
+            {
+                __atomic_or_fetch(&worker->summary.ready, 1u << level, __ATOMIC_RELEASE);
+                __atomic_add_fetch(&worker->steals, stolen, __ATOMIC_RELAXED);
+                if (victim->node != worker->node)
+                {
+                    __atomic_add_fetch(&worker->remote_steals, stolen, __ATOMIC_RELAXED);
+                }
+                return deque_take(&worker->runq[level]);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Takes a run-next thread which another worker has left waiting for
+// longer than RUNNEXT_GRACE_NS, or returns NULL.
+static uthread_t* steal_runnext(worker_t *worker)
+{
+    unsigned long long now = 0;
+    steal_order_t *order = __atomic_load_n(&worker->steal_order, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < MAX_WORKERS - 1; i++)
+    {
+        int id = order->ids[i];
+        if (id < 0)
+        {
+            break;
+        }
+        if (id >= __atomic_load_n(&scheduler.nworkers, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+
+        worker_t *victim = &scheduler.workers[id];
+        uthread_t *thread = __atomic_load_n(&victim->runnext, __ATOMIC_ACQUIRE);
+        if (!thread)
+        {
+            continue;
+        }
+        if (!now)
+        {
+            now = now_ns();
+        }
+        if (now - __atomic_load_n(&victim->runnext_at, __ATOMIC_RELAXED) > RUNNEXT_GRACE_NS &&
+            __atomic_compare_exchange_n(&victim->runnext, &thread, NULL, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            __atomic_add_fetch(&worker->steals, 1, __ATOMIC_RELAXED);
+            if (victim->node != worker->node)
+            {
+                __atomic_add_fetch(&worker->remote_steals, 1, __ATOMIC_RELAXED);
+            }
+            return thread;
+        }
+    }
+    return NULL;
+}
+
+// Finds the next queue entry for the worker to run, after taking in
+// any submitted threads: the highest priority one on its own queues,
+// unless another worker holds a more urgent one, which it steals.
+static uthread_t* find_entry(worker_t *worker)
+{
+    drain_injected();
+    int level = local_level(worker);
+    int next = runnext_level(worker);
+    uthread_t *thread = NULL;
+    if (scheduler.nworkers > 1 && level > 0 && next > 0)
+    {
+        thread = steal_work(worker, level < next ? level : next);
+    }
+    if (!thread)
+    {
+        thread = get_priority_thread(worker);
+    }
+    if (!thread && scheduler.nworkers > 1)
+    {
+        thread = steal_runnext(worker);
+    }
+    return thread;
+}
+
+// Returns a group member's node to its group's slab once the member
+// has finished with it.
+static void group_release(uthread_t *thread);
+
+// Drops a reference to the thread's node, freeing it with the last.
+static void put_node(uthread_t *thread)
+{
+    if (__atomic_sub_fetch(&thread->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+    if (thread->extra && thread->extra->group)
+    {
+        group_release(thread);
+        return;
+    }
+    free(thread->extra);
+    free(thread);
+}
+
+// Returns the thread's extra state, allocating it if the thread has
+// none yet. Only the thread itself, or whoever creates it, may call
+// this. Returns NULL if it couldn't be allocated.
+static thread_extra_t* extra_of(uthread_t *thread)
+{
+    if (!thread->extra)
+    {
+        thread->extra = (thread_extra_t *) calloc(1, sizeof(thread_extra_t));
+    }
+    return thread->extra;
+}
+
+// Finds the next thread for the worker to run. A thread whose priority
+// is raised while it is queued gets a second entry at its new level
+// rather than being dug out of the deque it is in, so whichever entry
+// is found first claims the thread, and the other is dropped when it
+// turns up.
+static uthread_t* find_work(worker_t *worker)
+{
+    while (1)
+    {
+        uthread_t *thread = find_entry(worker);
+        if (!thread || __atomic_exchange_n(&thread->queued, 0, __ATOMIC_ACQ_REL))
+        {
+            return thread;
+        }
+        put_node(thread);
+    }
+}
+
+// Returns whether any worker has threads queued, or any have been
+// submitted.
+static int work_pending(worker_t *worker)
+{
+    if (!mpsc_empty(&scheduler.inject) || __atomic_load_n(&worker->pinned_mask, __ATOMIC_SEQ_CST))
+    {
+        return 1;
+    }
+
+    int count = __atomic_load_n(&scheduler.nworkers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++)
+    {
+        worker_t *other = &scheduler.workers[i];
+        if (__atomic_load_n(&other->runnext, __ATOMIC_SEQ_CST))
+        {
+            return 1;
+        }
+        unsigned levels = __atomic_load_n(&other->summary.ready, __ATOMIC_SEQ_CST);
+        while (levels)
+        {
+            int level = __builtin_ctz(levels);
+            levels &= levels - 1;
+            if (!deque_empty(&other->runq[level]))
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Returns whether every thread has exited and no other kernel thread
+// may submit more, so the process should end.
+static int finished()
+{
+    return __atomic_load_n(&scheduler.live, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&scheduler.refs, __ATOMIC_SEQ_CST) == 0;
+}
+
+// Polls for work for up to spin_ns, unless enough workers are spinning
+// already. Returns whether there may be work.
+static int spin_for_work(worker_t *worker)
+{
+    int limit = __atomic_load_n(&scheduler.max_spinners, __ATOMIC_RELAXED);
+    if (limit < 0)
+    {
+        limit = (__atomic_load_n(&scheduler.running, __ATOMIC_RELAXED) + 1) / 2;
+    }
+    int spinning = __atomic_load_n(&scheduler.spinning, __ATOMIC_RELAXED);
+    do
+    {
+        if (spinning >= limit)
+        {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&scheduler.spinning, &spinning, spinning + 1, 1,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    unsigned long long deadline = now_ns() + __atomic_load_n(&scheduler.spin_ns, __ATOMIC_RELAXED);
+    int found;
+    while (!(found = work_pending(worker) || finished()) && now_ns() < deadline)
+    {
+        cpu_relax();
+    }
+
+    if (__atomic_sub_fetch(&scheduler.spinning, 1, __ATOMIC_SEQ_CST) == 0 && found &&
+        __atomic_load_n(&scheduler.idle_workers, __ATOMIC_SEQ_CST) > 0)
+    {
+        wake_one(worker);
+    }
+    return found;
+}
+
+// Returns whether nothing ties the worker to its kernel thread, so
+// that it may retire: it has no queued threads and no shared stack
+// threads.
+static int can_retire(worker_t *worker)
+{
+    return worker->elastic && local_level(worker) == UTHREAD_PRIORITY_LEVELS &&
+        !__atomic_load_n(&worker->runnext, __ATOMIC_ACQUIRE) &&
+        __atomic_load_n(&worker->homed, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Waits until there may be work for the worker, spinning first if it
+// may. The idle flag is set before the final check, so anyone queueing
+// work either sees it and wakes us, or their work is seen here. A
+// worker the supervisor started retires once it has been parked for
+// the linger time, unless woken meanwhile.
+static void idle_wait(worker_t *worker)
+{
+    if (spin_for_work(worker))
+    {
+        return;
+    }
+
+    __atomic_store_n(&worker->idle, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&scheduler.idle_workers, 1, __ATOMIC_SEQ_CST);
+    if (work_pending(worker) || finished())
+    {
+        __atomic_store_n(&worker->idle, 0, __ATOMIC_SEQ_CST);
+    }
+
+    unsigned long long linger = worker->elastic ?
+        __atomic_load_n(&scheduler.linger_ns, __ATOMIC_RELAXED) : 0;
+    while (park(worker, linger) != 0)
+    {
+        if (!can_retire(worker))
+        {
+            linger = 0;
+            continue;
+        }
+        if (__atomic_exchange_n(&worker->idle, 0, __ATOMIC_SEQ_CST))
+        {
+            __atomic_sub_fetch(&scheduler.idle_workers, 1, __ATOMIC_SEQ_CST);
+            setcontext(&worker->exit_context);
+        }
+    }
+    __atomic_sub_fetch(&scheduler.idle_workers, 1, __ATOMIC_SEQ_CST);
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                 Stack pool and lazy thread setup                //
+/////////////////////////////////////////////////////////////////////
+
+
+// A thread's context and stack live together in one block, with the
+// context at the start and the stack filling the rest. Blocks are
+// only acquired when a thread is first dispatched, so a queued thread
+// that has never run costs just its node. Released blocks are kept on
+// a worker's free list per stack size class, linked through their
+// first word, for the next thread. Stack sizes double from one class
+// to the next, and the default class is STACK_SIZE.
+#define DEFAULT_CLASS 2
+
+// Returns the stack size of the given class.
+static size_t class_size(int stack_class)
+{
+    return ((size_t) STACK_SIZE << stack_class) >> DEFAULT_CLASS;
+}
+
+// New blocks and shared stacks are carved from chunks which the worker
+// maps itself. Once the worker is pinned, its chunks are bound to the
+// memory of its NUMA node, so the stacks it hands out are local to it.
+// Chunks are only unmapped by the process ending, since blocks are
+// never returned to the system either.
+
+// Maps a chunk of the given size, which includes CHUNK_HEADER bytes
+// for linking it into the worker's list, binding it to the worker's
+// node if known. Returns NULL if it couldn't be mapped.
+static void* map_chunk(worker_t *worker, size_t size)
+{
+    void *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+#ifdef SYS_mbind
+    if (worker->node >= 0 && __atomic_load_n(&scheduler.nodes, __ATOMIC_RELAXED) > 1)
+    {
+        unsigned long mask = 1UL << worker->node;
+        syscall(SYS_mbind, chunk, size, MPOL_BIND_NODE, &mask, MAX_NODES + 1, 0);
+    }
+#endif
+    ((void **) chunk)[0] = worker->chunks;
+    ((size_t *) chunk)[1] = size;
+    worker->chunks = chunk;
+    return chunk;
+}
+
+// Allocates size bytes of the worker's node-local memory. Large
+// requests get a chunk of their own. Returns NULL if the memory
+// couldn't be allocated.
+static void* chunk_alloc(worker_t *worker, size_t size)
+{
+    size = (size + 63) & ~(size_t) 63;
+    if (size > (CHUNK_SIZE - CHUNK_HEADER) / 2)
+    {
+        char *chunk = (char *) map_chunk(worker, size + CHUNK_HEADER);
+        return chunk ? chunk + CHUNK_HEADER : NULL;
+    }
+    if (size > worker->chunk_left)
+    {
+        char *chunk = (char *) map_chunk(worker, CHUNK_SIZE);
+        if (!chunk)
+        {
+            return NULL;
+        }
+        worker->chunk = chunk + CHUNK_HEADER;
+        worker->chunk_left = CHUNK_SIZE - CHUNK_HEADER;
+    }
+
+    void *memory = worker->chunk;
+    worker->chunk += size;
+    worker->chunk_left -= size;
+    return memory;
+}
+
+// Takes a block of the given class from the worker's pool, allocating
+// one if the pool is empty. This is kept out of line since make_block
+// calls getcontext, which the compiler treats like setjmp.
+static __attribute__((noinline)) ucontext_t* acquire_block(worker_t *worker, int stack_class)
+{
+    void *block = worker->free_blocks[stack_class];
+    if (block)
+    {
+        worker->free_blocks[stack_class] = *(void **) block;
+        return (ucontext_t *) block;
+    }
+    return (ucontext_t *) chunk_alloc(worker, sizeof(ucontext_t) + class_size(stack_class));
+}
+
+// Returns the thread's block to the worker's pool.
+static void release_block(worker_t *worker, uthread_t *thread)
+{
+    if (thread->context)
+    {
+        *(void **) thread->context = worker->free_blocks[thread->stack_class];
+        worker->free_blocks[thread->stack_class] = thread->context;
+        thread->context = NULL;
+    }
+}
+
+// Threads created with UTHREAD_ARENA allocate from arena blocks taken
+// from the same chunks and the same kind of per-worker pool as stacks.
+// An allocation just moves a pointer along the newest block, taking
+// another block when it is full. Nothing is freed on its own; all the
+// thread's blocks go back to the pool when it exits. Each block starts
+// with a link to the thread's previous one, padded to keep allocations
+// 16-byte aligned.
+
+// Takes an arena block from the worker's pool, allocating one if the
+// pool is empty, and makes it the thread's newest. The thread must
+// have its extra state. Returns -1 if no block could be allocated.
+static int add_arena(worker_t *worker, uthread_t *thread)
+{
+    void *block = worker->free_arenas;
+    if (block)
+    {
+        worker->free_arenas = *(void **) block;
+    }
+    else if (!(block = chunk_alloc(worker, ARENA_SIZE)))
+    {
+        return -1;
+    }
+
+    thread_extra_t *extra = thread->extra;
+    *(void **) block = extra->arenas;
+    extra->arenas = block;
+    extra->arena_next = (char *) block + ARENA_HEADER;
+    extra->arena_left = ARENA_SIZE - ARENA_HEADER;
+    return 0;
+}
+
+// Returns all of the thread's arena blocks to the worker's pool.
+static void release_arenas(worker_t *worker, uthread_t *thread)
+{
+    thread_extra_t *extra = thread->extra;
+    if (!extra)
+    {
+        return;
+    }
+    void *block = extra->arenas;
+    while (block)
+    {
+        void *next = *(void **) block;
+        *(void **) block = worker->free_arenas;
+        worker->free_arenas = block;
+        block = next;
+    }
+    extra->arenas = NULL;
+    extra->arena_left = 0;
+}
+
+// Blocks have no guard page, since they are packed into chunks, so
+// make_block puts a canary word at the low end of every stack instead.
+// A thread that ran off the end of its stack has overwritten it, along
+// with its own context and perhaps the block below. The canary is
+// checked every time a thread switches away and when it exits, and the
+// process is aborted if it is gone, since nothing on that worker can be
+// trusted any more.
+
+// Aborts the process if the stack of the given block has overflowed.
+// thread is the one running on it, or NULL for a dispatch loop.
+static void check_block(ucontext_t *block, uthread_t *thread)
+{
+    unsigned long long *canary = (unsigned long long *) ((char *) block + sizeof(ucontext_t));
+    if (*canary == STACK_CANARY)
+    {
+        return;
+    }
+
+    if (thread)
+    {
+        fprintf(stderr, "uthread: stack overflow in a thread running %p with a %zu byte stack\n",
+                (void *) (thread->func ? thread->func : (void (*)()) thread->task),
+                class_size(thread->stack_class));
+    }
+    else
+    {
+        fprintf(stderr, "uthread: stack overflow in a task on the dispatch loop's stack\n");
+    }
+    abort();
+}
+
+// Aborts the process if the thread has run off the end of its stack.
+// Shared stack threads don't have a block of their own.
+static void check_stack(uthread_t *thread)
+{
+    if (thread->context && !(thread->flags & UTHREAD_SHARED_STACK))
+    {
+        check_block(thread->context, thread);
+    }
+}
+
+// When stack painting is on, every stack handed out is first filled
+// with a pattern. When the thread exits, the lowest overwritten word
+// gives the deepest its stack ever got, which is recorded against its
+// function. Later threads running that function get a larger size
+// class if a previous run needed more than the default. A run deeper
+// than its class is caught by the canary rather than measured.
+static int stack_painting = 0;
+
+// When stack shrinking is on, measured functions may also get a class
+// smaller than the default, down to MIN_CLASS. A run only measures the
+// paths it took, so the stack picked keeps STACK_HEADROOM bytes beyond
+// it for libc calls and signal frames the measured runs never hit.
+static int stack_shrinking = 0;
+
+#define MIN_CLASS 1
+#define STACK_HEADROOM 4096
+
+// Stack high-water marks for every function that has run on a painted
+// stack, hashed by function pointer.
+typedef struct stack_stats
+{
+    void (*func)();             // Thread function code
+    size_t high_water;          // Deepest stack use seen, in bytes
+    unsigned long runs;         // Number of runs measured
+    struct stack_stats *next;   // Next function in the bucket
+} stack_stats_t;
+
+static stack_stats_t *stack_stats[STACK_STATS_BUCKETS];
+
+// Returns the stats bucket for the given function.
+static stack_stats_t** stack_bucket(void (*func)())
+{
+    return &stack_stats[((unsigned long) func >> 4) % STACK_STATS_BUCKETS];
+}
+
+// Returns the stack stats for the given function, or NULL if it has
+// never run on a painted stack.
+static stack_stats_t* find_stack_stats(void (*func)())
+{
+    stack_stats_t *curr = *stack_bucket(func);
+    while (curr && curr->func != func)
+    {
+        curr = curr->next;
+    }
+    return curr;
+}
+
+// Returns the function the thread runs, which its stack use is
+// recorded against.
+static void (*entry_of(uthread_t *thread))()
+{
+    return thread->func ? thread->func : (void (*)()) thread->task;
+}
+
+// Returns the smallest size class whose stack fits every run measured
+// in stats with half again as much plus STACK_HEADROOM to spare. The
+// class is never below the default unless stack shrinking is on, and
+// never below MIN_CLASS. Must be called with lock held.
+static int fit_stack_class(stack_stats_t *stats)
+{
+    size_t needed = stats->high_water + stats->high_water / 2 + STACK_HEADROOM;
+    int stack_class = stack_shrinking ? MIN_CLASS : DEFAULT_CLASS;
+    while (stack_class < STACK_CLASSES - 1 && class_size(stack_class) < needed)
+    {
+        stack_class++;
+    }
+    return stack_class;
+}
+
+// Returns the size class for a new thread running the function, or the
+// default class if it has never been measured.
+static int pick_stack_class(void (*func)())
+{
+    lock_acquire(&lock);
+    stack_stats_t *stats = find_stack_stats(func);
+    int stack_class = stats ? fit_stack_class(stats) : DEFAULT_CLASS;
+    lock_release(&lock);
+    return stack_class;
+}
+
+// Measures how much of the thread's painted stack was used and
+// records it against the thread's function.
+static void measure_stack(uthread_t *thread)
+{
+    unsigned long long *base = (unsigned long long *) thread->context->uc_stack.ss_sp;
+    unsigned long long *end = base + thread->context->uc_stack.ss_size / sizeof(*base);
+    unsigned long long *curr = base + 1;
+    while (curr < end && *curr == STACK_PATTERN)
+    {
+        curr++;
+    }
+    size_t used = (char *) end - (char *) curr;
+
+    void (*func)() = entry_of(thread);
+    lock_acquire(&lock);
+    stack_stats_t *stats = find_stack_stats(func);
+    if (!stats)
+    {
+        stats = (stack_stats_t *) calloc(1, sizeof(stack_stats_t));
+        if (!stats)
+        {
+            lock_release(&lock);
+            return;
+        }
+        stats->func = func;
+        stats->next = *stack_bucket(func);
+        *stack_bucket(func) = stats;
+    }
+    if (used > stats->high_water)
+    {
+        stats->high_water = used;
+    }
+    stats->runs++;
+    lock_release(&lock);
+}
+
+// Takes a block of the given class from the worker's pool and makes its
+// context run entry() on the block's stack, painting the stack first
+// if painting is on and putting the canary at its low end. Returns
+// NULL if no block could be allocated.
+static ucontext_t* make_block(worker_t *worker, void (*entry)(), int stack_class)
+{
+    ucontext_t *context = acquire_block(worker, stack_class);
+    if (!context)
+    {
+        return NULL;
+    }
+
+    getcontext(context);
+    context->uc_stack.ss_sp = (char *) context + sizeof(ucontext_t);
+    context->uc_stack.ss_size = class_size(stack_class);
+    context->uc_link = NULL;
+    if (stack_painting)
+    {
+        unsigned long long *curr = (unsigned long long *) context->uc_stack.ss_sp;
+        for (size_t i = 0; i < context->uc_stack.ss_size / sizeof(*curr); i++)
+        {
+            curr[i] = STACK_PATTERN;
+        }
+    }
+    *(unsigned long long *) context->uc_stack.ss_sp = STACK_CANARY;
+    makecontext(context, entry, 0);
+    return context;
+}
+
+// Entry point for every thread's context. Returning from the thread
+// function is treated the same as calling uthread_exit.
+static void thread_start();
+
+// Threads created with UTHREAD_SHARED_STACK all run on one large
+// stack per worker. Whichever of them last ran owns it; the others
+// keep just the part of the stack they were using, copied out into a
+// buffer sized to fit. The copying has to happen off the shared stack,
+// so these threads are always switched in by the dispatch loop. Their
+// frames hold addresses on their worker's shared stack, so once they
+// have run they are pinned to that worker.
+
+// Returns whether the thread runs on the shared stack.
+static int is_shared(uthread_t *thread)
+{
+    return thread->flags & UTHREAD_SHARED_STACK;
+}
+
+// Records how much of the shared stack the thread is using as it
+// switches away. The margin covers the frames below the caller, down
+// to where the switch saves the thread's registers.
+static void mark_stack(uthread_t *thread)
+{
+    if (is_shared(thread))
+    {
+        char *base = thread->home->shared_stack;
+        thread->extra->stack_sp = (char *) __builtin_frame_address(0) - SHARED_STACK_MARGIN;
+        if (thread->extra->stack_sp < base)
+        {
+            thread->extra->stack_sp = base;
+        }
+    }
+}
+
+// Copies the used part of the shared stack out of the owner. This
+// function returns 0 if succeeds, or -1 otherwise.
+static int save_shared(worker_t *worker, uthread_t *owner)
+{
+    thread_extra_t *extra = owner->extra;
+    size_t size = worker->shared_stack + SHARED_STACK_SIZE - extra->stack_sp;
+    if (size > extra->saved_cap || size < extra->saved_cap / 2)
+    {
+        char *saved = (char *) realloc(extra->saved_stack, size);
+        if (!saved)
+        {
+            return -1;
+        }
+        extra->saved_stack = saved;
+        extra->saved_cap = size;
+    }
+    memcpy(extra->saved_stack, extra->stack_sp, size);
+    extra->saved_size = size;
+    return 0;
+}
+
+// Puts the thread's stack back on the worker's shared stack, saving
+// the current owner's first, and returns its context. The first time
+// the thread runs, its context is made fresh on the shared stack and
+// it is pinned to the worker. Returns NULL if memory couldn't be
+// allocated.
+static ucontext_t* restore_shared(worker_t *worker, uthread_t *thread)
+{
+    if (!worker->shared_stack)
+    {
+        worker->shared_stack = (char *) chunk_alloc(worker, SHARED_STACK_SIZE);
+        if (!worker->shared_stack)
+        {
+            return NULL;
+        }
+    }
+    if (worker->shared_owner == thread)
+    {
+        return thread->context;
+    }
+    if (worker->shared_owner && save_shared(worker, worker->shared_owner) != 0)
+    {
+        return NULL;
+    }
+    worker->shared_owner = NULL;
+
+    if (thread->context)
+    {
+        memcpy(worker->shared_stack + SHARED_STACK_SIZE - thread->extra->saved_size,
+               thread->extra->saved_stack, thread->extra->saved_size);
+    }
+    else
+    {
+        thread->context = (ucontext_t *) malloc(sizeof(ucontext_t));
+        if (!thread->context)
+        {
+            return NULL;
+        }
+        getcontext(thread->context);
+        thread->context->uc_stack.ss_sp = worker->shared_stack;
+        thread->context->uc_stack.ss_size = SHARED_STACK_SIZE;
+        thread->context->uc_link = NULL;
+        makecontext(thread->context, thread_start, 0);
+        thread->home = worker;
+        __atomic_add_fetch(&worker->homed, 1, __ATOMIC_RELEASE);
+    }
+    worker->shared_owner = thread;
+    return thread->context;
+}
+
+// Frees an exited thread's node along with its stack, or whatever it
+// was holding of the shared stack.
+static void release_thread(worker_t *worker, uthread_t *thread)
+{
+    release_arenas(worker, thread);
+    if (is_shared(thread))
+    {
+        if (thread->home)
+        {
+            if (thread->home->shared_owner == thread)
+            {
+                thread->home->shared_owner = NULL;
+            }
+            __atomic_sub_fetch(&thread->home->homed, 1, __ATOMIC_RELEASE);
+        }
+        free(thread->context);
+        free(thread->extra->saved_stack);
+        thread->extra->saved_stack = NULL;
+    }
+    else
+    {
+        if (thread->painted)
+        {
+            measure_stack(thread);
+        }
+        release_block(worker, thread);
+    }
+    put_node(thread);
+}
+
+// Gives the thread a stack and context the first time it is handed
+// out by get_priority_thread. This function returns 0 if succeeds, or
+// -1 otherwise.
+static int prepare_thread(worker_t *worker, uthread_t *thread)
+{
+    if (!thread->context)
+    {
+        thread->stack_class = pick_stack_class(entry_of(thread));
+        thread->painted = stack_painting;
+        thread->context = make_block(worker, thread_start, thread->stack_class);
+    }
+    return thread->context ? 0 : -1;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                         Worker topology                         //
+/////////////////////////////////////////////////////////////////////
+
+
+// When there is a CPU for every worker, each worker is pinned to its
+// own CPU, and its stack pool comes from that CPU's NUMA node. Thieves
+// then try victims on the same core first, then the same node, then
+// the same socket, and only then other sockets, so a stolen thread's
+// stack and working set stay close where they can. Topology is read
+// from /sys unless uthread_set_topology gave one; where neither is
+// available workers are left unpinned and steal in any order.
+
+// Where a CPU sits in the machine. Places read from /sys give as core
+// the lowest CPU number sharing the physical core.
+typedef uthread_place_t place_t;
+
+#if UTHREAD_LOCKING != UTHREAD_LOCK_NONE
+// Reads the first line of a file under /sys into buf. This function
+// returns 0 if succeeds, or -1 otherwise.
+static int read_sysfs(const char *path, char *buf, int size)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        return -1;
+    }
+    char *line = fgets(buf, size, file);
+    fclose(file);
+    return line ? 0 : -1;
+}
+
+// Returns whether cpu is in a CPU list such as "0-3,8-11".
+static int in_cpulist(const char *list, int cpu)
+{
+    for (;;)
+    {
+        char *end;
+        long first = strtol(list, &end, 10);
+        if (end == list)
+        {
+            return 0;
+        }
+        long last = first;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+        }
+        if (cpu >= first && cpu <= last)
+        {
+            return 1;
+        }
+        if (*end != ',')
+        {
+            return 0;
+        }
+        list = end + 1;
+    }
+}
+
+// Finds where the given CPU sits.
+static void find_place(int cpu, place_t *place)
+{
+    char path[128];
+    char buf[256];
+    place->cpu = cpu;
+    place->core = cpu;
+    place->package = 0;
+    place->node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    if (read_sysfs(path, buf, sizeof(buf)) == 0)
+    {
+        place->core = atoi(buf);
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+    if (read_sysfs(path, buf, sizeof(buf)) == 0)
+    {
+        place->package = atoi(buf);
+    }
+    for (int node = 0; node < MAX_NODES; node++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (read_sysfs(path, buf, sizeof(buf)) == 0 && in_cpulist(buf, cpu))
+        {
+            place->node = node;
+            break;
+        }
+    }
+}
+
+// Finds the CPUs the process may run on, in CPU number order, and
+// where each sits. Returns how many were found, at most max.
+static int find_places(place_t *places, int max)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        return 0;
+    }
+
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set))
+        {
+            find_place(cpu, &places[count++]);
+        }
+    }
+    return count;
+#else
+    (void) places;
+    (void) max;
+    return 0;
+#endif
+}
+
+// Pins the calling kernel thread to the worker's CPU, if it has one.
+static void pin_worker(worker_t *worker)
+{
+#ifdef __linux__
+    if (worker->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#else
+    (void) worker;
+#endif
+}
+
+// Returns how far apart two workers are: 0 on the same core, 1 on the
+// same NUMA node, 2 on the same socket, and 3 otherwise.
+static int distance(worker_t *a, worker_t *b)
+{
+    if (a->core >= 0 && a->core == b->core && a->package == b->package)
+    {
+        return 0;
+    }
+    if (a->node == b->node)
+    {
+        return 1;
+    }
+    return a->package == b->package ? 2 : 3;
+}
+
+// Orders the steal victims of each of the first count workers nearest
+// first. Workers equally far are taken in turn from the one after the
+// thief, so that thieves spread out over them. Each worker's new order
+// is built aside and then published whole. This function returns 0 if
+// succeeds, or -1 otherwise.
+static int order_victims(int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        steal_order_t *order = (steal_order_t *) malloc(sizeof(steal_order_t));
+        if (!order)
+        {
+            return -1;
+        }
+
+        worker_t *worker = &scheduler.workers[i];
+        int n = 0;
+        for (int d = 0; d <= 3; d++)
+        {
+            for (int j = 1; j < count; j++)
+            {
+                worker_t *victim = &scheduler.workers[(i + j) % count];
+                if (distance(worker, victim) == d)
+                {
+                    order->ids[n++] = victim->id;
+                }
+            }
+        }
+        order->ids[n] = -1;
+        __atomic_store_n(&worker->steal_order, order, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// The CPUs the process may run on, found when workers are first
+// started unless uthread_set_topology gave them.
+static place_t places[MAX_WORKERS];
+static int nplaces = -1;
+
+// Returns the place for the worker in the given slot, or NULL if it
+// isn't to be pinned.
+static place_t* place_for(int id)
+{
+    if (nplaces < 0)
+    {
+        nplaces = find_places(places, MAX_WORKERS);
+    }
+    return scheduler.pin_workers && id < nplaces ? &places[id] : NULL;
+}
+
+// Returns the number of different NUMA nodes among the places.
+static int count_nodes(place_t *places, int count)
+{
+    unsigned long long seen = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (places[i].node >= 0)
+        {
+            seen |= 1ULL << places[i].node;
+        }
+    }
+    return seen ? __builtin_popcountll(seen) : 1;
+}
+#endif
+
+// Records the CPU the worker is to run on, or that it has none if
+// place is NULL.
+static void set_place(worker_t *worker, place_t *place)
+{
+    worker->cpu = place ? place->cpu : -1;
+    worker->core = place ? place->core : -1;
+    worker->package = place ? place->package : -1;
+    worker->node = place ? place->node : -1;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                     Library implementation                      //
+/////////////////////////////////////////////////////////////////////
+
+
+// Off-CPU totals per wait reason, and per thread name. Threads which
+// were never named are charged to the head of the list.
+static unsigned long long offcpu_total[UTHREAD_WAIT_REASONS];
+static name_stats_t unnamed_stats = { "(unnamed)", { 0 }, NULL };
+
+// Marks the thread as off-CPU for the given reason.
+static void wait_begin(uthread_t *thread, int reason)
+{
+    thread->wait_reason = reason;
+    thread->wait_start = now_ns();
+}
+
+// Charges the time since wait_begin to the thread's wait reason. This
+// is a no-op if the thread isn't waiting, e.g. before it first runs.
+static void wait_end(uthread_t *thread)
+{
+    if (thread->wait_reason < 0)
+    {
+        return;
+    }
+
+    unsigned long long elapsed = now_ns() - thread->wait_start;
+    __atomic_add_fetch(&offcpu_total[thread->wait_reason], elapsed, __ATOMIC_RELAXED);
+    name_stats_t *stats = thread->extra && thread->extra->stats ? thread->extra->stats : &unnamed_stats;
+    __atomic_add_fetch(&stats->offcpu[thread->wait_reason], elapsed, __ATOMIC_RELAXED);
+    thread->wait_reason = -1;
+}
+
+// Wakes the thread by putting it on a run queue. Whatever it was
+// parked on is charged up to now, and from here until it is dispatched
+// it is waiting for a kernel thread.
+static void ready(uthread_t *thread)
+{
+    wait_end(thread);
+    wait_begin(thread, UTHREAD_WAIT_PREEMPTED);
+    enqueue(thread);
+}
+
+// Wakes a thread blocked by the running one. If it is at least as
+// urgent as its waker, it runs next on this worker, before threads
+// queued at its level.
+static inline void wake(uthread_t *thread)
+{
+    worker_t *worker = current();
+    uthread_t *waker = worker->active;
+    if (thread->home || !waker || thread->priority > waker->priority)
+    {
+        ready(thread);
+        return;
+    }
+
+    wait_end(thread);
+    wait_begin(thread, UTHREAD_WAIT_PREEMPTED);
+    put_runnext(worker, thread, thread->wait_start);
+}
+
+// Returns the stats entry for the given name, or NULL if no thread has
+// been given that name.
+static name_stats_t* find_stats(const char *name)
+{
+    name_stats_t *curr = &unnamed_stats;
+    while (curr && strncmp(curr->name, name, NAME_SIZE - 1) != 0)
+    {
+        curr = curr->next;
+    }
+    return curr;
+}
+
+// Tasks run on the dispatch loop's stack with a plain function call.
+// Stackful threads switch straight to each other, and only go through
+// the dispatch loop when the next thread to run is a task or a shared
+// stack thread, or there is nothing to run.
+static void schedule();
+
+// Runs the thread's blocking call on a helper kernel thread, then puts
+// the thread back on a run queue.
+static void offload(uthread_t *thread);
+
+// Sets the priority the thread asks for, keeping any boost from
+// waiters on mutexes it holds.
+static void set_priority(uthread_t *thread, int priority);
+
+// Does whatever the thread that last switched away on this worker
+// left to be done once its context was saved. Everything that resumes
+// after a switch calls this first.
+static void finish_switch(worker_t *worker)
+{
+    uthread_t *prev = worker->prev;
+    if (!prev)
+    {
+        return;
+    }
+
+    worker->prev = NULL;
+    check_stack(prev);
+    if (worker->prev_action == SWITCH_READY)
+    {
+        ready(prev);
+    }
+    else if (worker->prev_action == SWITCH_EXIT)
+    {
+        release_thread(worker, prev);
+    }
+    else if (worker->prev_action == SWITCH_BLOCK)
+    {
+        offload(prev);
+    }
+    else if (worker->prev_action == SWITCH_PARK)
+    {
+        waitq_release(worker->park_lock);
+    }
+}
+
+// Returns whether the thread is a task which hasn't needed a stack.
+static int is_task(uthread_t *thread)
+{
+    return thread->stackless;
+}
+
+// Gives a running task a stack of its own so that it can switch away.
+// The task keeps the stack it is running on, which was the dispatch
+// loop's, and the loop starts over on a fresh block. This function
+// returns 0 if succeeds, or -1 otherwise.
+static int promote_task(worker_t *worker, uthread_t *task)
+{
+    ucontext_t *block = make_block(worker, schedule, DEFAULT_CLASS);
+    if (!block)
+    {
+        return -1;
+    }
+
+    task->context = worker->sched_block;
+    task->stack_class = DEFAULT_CLASS;
+    task->stackless = 0;
+    worker->sched_block = block;
+    return 0;
+}
+
+// Makes the thread the worker's active one, counting the dispatch for
+// the supervisor.
+static void set_active(worker_t *worker, uthread_t *thread)
+{
+    worker->active = thread;
+    __atomic_store_n(&worker->dispatches, worker->dispatches + 1, __ATOMIC_RELAXED);
+}
+
+// Makes the thread the worker's active one and returns the context to
+// switch to in order to run it, or NULL if it needs a stack and none
+// could be allocated. Tasks and shared stack threads are handed to the
+// dispatch loop, which marks them active itself.
+static ucontext_t* dispatch(worker_t *worker, uthread_t *thread)
+{
+    if (is_task(thread) || is_shared(thread))
+    {
+        worker->handoff = thread;
+        return worker->sched_block;
+    }
+    if (prepare_thread(worker, thread) != 0)
+    {
+        return NULL;
+    }
+
+    wait_end(thread);
+    set_active(worker, thread);
+    return thread->context;
+}
+
+// Switches the worker from its active thread save to another ready
+// thread, or to the dispatch loop if there are none, leaving action for
+// whoever runs next to carry out once save's context is saved. Returns
+// when save is run again.
+static void switch_away(worker_t *worker, uthread_t *save, int action)
+{
+    ucontext_t *target = worker->sched_block;
+    uthread_t *thread = find_work(worker);
+    if (thread)
+    {
+        target = dispatch(worker, thread);
+        if (!target)
+        {
+            enqueue(thread);
+            target = worker->sched_block;
+        }
+    }
+
+    worker->prev = save;
+    worker->prev_action = action;
+    mark_stack(save);
+    swapcontext(save->context, target);
+    finish_switch(current());
+}
+
+// Frees everything and ends the process once no threads are left.
+// With more than one worker the others may still be on their way to
+// sleep, so their memory is left for the process exit to reclaim. The
+// stack chunks always are, since we are running on one of them.
+static void terminate()
+{
+    if (scheduler.nworkers == 1)
+    {
+        worker_t *worker = &scheduler.workers[0];
+        for (int level = 0; level < UTHREAD_PRIORITY_LEVELS; level++)
+        {
+            cleanup_deque(&worker->runq[level]);
+        }
+#ifndef __linux__
+        close(worker->wake_fd[0]);
+        close(worker->wake_fd[1]);
+#endif
+        lock_destroy(&worker->pin_lock);
+        lock_destroy(&lock);
+    }
+    exit(0);
+}
+
+// The steal order of a worker with no others to steal from.
+static steal_order_t no_victims = { { -1 } };
+
+// Sets up a worker's run queues and dispatch loop, on the given CPU if
+// place isn't NULL. This function returns 0 if succeeds, or -1
+// otherwise.
+static int init_worker(worker_t *worker, int id, place_t *place)
+{
+    memset(worker, 0, sizeof(worker_t));
+    worker->id = id;
+    set_place(worker, place);
+    worker->steal_order = &no_victims;
+    lock_init(&worker->pin_lock);
+    for (int level = 0; level < UTHREAD_PRIORITY_LEVELS; level++)
+    {
+        if (deque_init(&worker->runq[level]) != 0)
+        {
+            return -1;
+        }
+    }
+    worker->sched_block = make_block(worker, schedule, DEFAULT_CLASS);
+    if (!worker->sched_block || wake_open(worker) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// This function is called before any other uthread library
+// functions can be called. It initializes the uthread system.
+void system_init()
+{
+    // Initialize the lock
+    lock_init(&lock);
+
+    // Set up the injection queue for other kernel threads
+    mpsc_init(&scheduler.inject);
+    scheduler.inject_busy = 0;
+    scheduler.refs = 0;
+    scheduler.live = 1;
+    scheduler.idle_workers = 0;
+    scheduler.spinning = 0;
+    scheduler.max_spinners = -1;
+    scheduler.spin_ns = SPIN_NS;
+
+    // The calling kernel thread is the first worker
+    scheduler.nodes = 1;
+    if (init_worker(&scheduler.workers[0], 0, NULL) != 0)
+    {
+        perror("uthread: system_init");
+        exit(1);
+    }
+    scheduler.nworkers = 1;
+    scheduler.running = 1;
+    scheduler.peak_running = 1;
+    scheduler.started = 1;
+    scheduler.linger_ns = LINGER_NS;
+    current_worker = &scheduler.workers[0];
+}
+
+// Initializes a node for a uthread with the given priority.
+static void init_thread(uthread_t *thread, int priority)
+{
+    thread->priority = priority;
+    thread->base_priority = priority;
+    thread->queued = 0;
+    thread->refs = 1;
+    thread->pi_held = NULL;
+    thread->func = NULL;
+    thread->task = NULL;
+    thread->arg = NULL;
+    thread->stackless = 0;
+    thread->painted = 0;
+    thread->flags = 0;
+    thread->home = NULL;
+    thread->pin_level = -1;
+    thread->wait_reason = -1;
+    thread->park_addr = NULL;
+    thread->cancelled = 0;
+    thread->wait_queue = NULL;
+    thread->extra = NULL;
+    memset(thread->specific, 0, sizeof(thread->specific));
+
+    // The stack and context are set up when the thread first runs
+    thread->context = NULL;
+}
+
+// Allocates and initializes a node for a uthread with the given
+// priority. Returns NULL if the node couldn't be allocated.
+static uthread_t* new_thread(int priority)
+{
+    uthread_t *thread = (uthread_t *) malloc(sizeof(uthread_t));
+    if (thread)
+    {
+        init_thread(thread, priority);
+    }
+    return thread;
+}
+
+// Runs the destructors of the thread's thread-local values.
+static void run_destructors(uthread_t *thread);
+
+// Unwinds the thread if it has been cancelled.
+static void cancel_point(uthread_t *thread);
+
+// This function creates a new user-level thread which runs func(),
+// with priority number specified by argument priority. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_create(void func(), int priority)
+{
+    return uthread_create_flags(func, priority, 0);
+}
+
+// This function creates a new user-level thread like uthread_create,
+// with the UTHREAD_* options given by argument flags. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_create_flags(void func(), int priority, int flags)
+{
+    // Allocate a node for the uthread
+    uthread_t *thread = new_thread(priority);
+    if (!thread)
+    {
+        return -1;
+    }
+    thread->func = func;
+    thread->flags = flags;
+    if ((flags & UTHREAD_SHARED_STACK) && !extra_of(thread))
+    {
+        free(thread);
+        return -1;
+    }
+
+    // Add the thread to the queue
+    __atomic_add_fetch(&scheduler.live, 1, __ATOMIC_SEQ_CST);
+    enqueue(thread);
+
+    return 0;
+}
+
+// The calling thread requests to yield the kernel thread that
+// it is currently running to one of other user threads which
+// has the highest priority level among the ready threads if
+// there is one or more other threads ready to run. If no
+// any other thread is ready to run, the calling thread should
+// proceed to run on the kernel thread. This function returns 0
+// if succeeds, or -1 otherwise.
+int uthread_yield(int priority)
+{
+    worker_t *worker = current();
+    uthread_t *save = worker ? worker->active : NULL;
+    if (!save)
+    {
+        return -1;
+    }
+    cancel_point(save);
+
+    // Find the next thread to run
+    uthread_t *thread = find_work(worker);
+    if (!thread)
+    {
+        return -1;
+    }
+
+    // A task has to be given a stack before it can be switched away from
+    ucontext_t *target = NULL;
+    if (!is_task(save) || promote_task(worker, save) == 0)
+    {
+        target = dispatch(worker, thread);
+    }
+    if (!target)
+    {
+        enqueue(thread);
+        return -1;
+    }
+    set_priority(save, priority);
+
+    // Swap contexts; whoever runs next puts the yielding thread back
+    // on the queue once its context is saved
+    worker->prev = save;
+    worker->prev_action = SWITCH_READY;
+    mark_stack(save);
+    swapcontext(save->context, target);
+    finish_switch(current());
+    cancel_point(save);
+
+    return 0;
+}
+
+// The calling user-level thread ends its execution.
+void uthread_exit()
+{
+    // A task is still on the dispatch loop's stack, so it just returns
+    // to the loop
+    worker_t *worker = current();
+    uthread_t *save = worker->active;
+    if (save && is_task(save))
+    {
+        _longjmp(worker->task_env, 1);
+    }
+    if (save)
+    {
+        run_destructors(save);
+        check_stack(save);
+    }
+
+    // Terminate when there are no more threads, unless another kernel
+    // thread may still submit one. The kernel thread which called
+    // system_init counts as a thread until it calls this.
+    if (__atomic_sub_fetch(&scheduler.live, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&scheduler.refs, __ATOMIC_SEQ_CST) == 0)
+    {
+        terminate();
+    }
+    worker->active = NULL;
+
+    // Retrieve a uthread from the queue, or look for one in the
+    // dispatch loop
+    ucontext_t *target = worker->sched_block;
+    uthread_t *thread = find_work(worker);
+    if (thread)
+    {
+        target = dispatch(worker, thread);
+        if (!target)
+        {
+            fprintf(stderr, "uthread: unable to allocate a thread stack\n");
+            exit(1);
+        }
+    }
+
+    // Set the context and run the thread. The exiting thread's block
+    // goes back to the pool only after the switch, so the thread being
+    // dispatched can't have been handed the stack we are still on.
+    if (save)
+    {
+        worker->prev = save;
+        worker->prev_action = SWITCH_EXIT;
+    }
+    setcontext(target);
+}
+
+// This function queues func(arg) to run as a stackless task with
+// priority number specified by argument priority. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_spawn_task(void (*fn)(void *), void *arg, int priority)
+{
+    uthread_t *thread = new_thread(priority);
+    if (!thread)
+    {
+        return -1;
+    }
+    thread->task = fn;
+    thread->arg = arg;
+    thread->stackless = 1;
+
+    __atomic_add_fetch(&scheduler.live, 1, __ATOMIC_SEQ_CST);
+    enqueue(thread);
+
+    return 0;
+}
+
+
+// Entry point for every thread's context. Returning from the thread
+// function is treated the same as calling uthread_exit.
+static void thread_start()
+{
+    worker_t *worker = current();
+    finish_switch(worker);
+
+    uthread_t *thread = worker->active;
+    cancel_point(thread);
+    if (thread->func)
+    {
+        thread->func();
+    }
+    else
+    {
+        thread->task(thread->arg);
+    }
+    uthread_exit();
+}
+
+// Runs a task to completion on the dispatch loop's stack. If the task
+// was promoted while it ran, this stack is now the task's own and the
+// loop has moved on without us, so it exits like any other thread.
+static void run_task(worker_t *worker, uthread_t *thread)
+{
+    set_active(worker, thread);
+    if (!_setjmp(worker->task_env))
+    {
+        cancel_point(thread);
+        thread->task(thread->arg);
+    }
+    if (!thread->stackless)
+    {
+        uthread_exit();
+    }
+
+    run_destructors(thread);
+    worker->active = NULL;
+    put_node(thread);
+    if (__atomic_sub_fetch(&scheduler.live, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&scheduler.refs, __ATOMIC_SEQ_CST) == 0)
+    {
+        terminate();
+    }
+}
+
+// The dispatch loop. It runs any task or shared stack thread handed
+// to it by another thread, and otherwise the highest priority thread
+// on the worker's queues or one stolen from another worker, sleeping
+// while there are none. No thread is active while the loop runs, so
+// that spinners don't take a thread which switched away for running.
+static void schedule()
+{
+    for (;;)
+    {
+        worker_t *worker = current();
+        __atomic_store_n(&worker->active, NULL, __ATOMIC_RELAXED);
+        finish_switch(worker);
+
+        uthread_t *thread = worker->handoff;
+        worker->handoff = NULL;
+        if (!thread)
+        {
+            thread = find_work(worker);
+        }
+        if (!thread)
+        {
+            if (finished())
+            {
+                terminate();
+            }
+            idle_wait(worker);
+            continue;
+        }
+
+        if (is_task(thread))
+        {
+            run_task(worker, thread);
+            check_block(worker->sched_block, NULL);
+            continue;
+        }
+
+        ucontext_t *target;
+        if (is_shared(thread))
+        {
+            target = restore_shared(worker, thread);
+            wait_end(thread);
+            set_active(worker, thread);
+        }
+        else
+        {
+            target = dispatch(worker, thread);
+        }
+        if (!target)
+        {
+            fprintf(stderr, "uthread: unable to allocate a thread stack\n");
+            exit(1);
+        }
+        swapcontext(worker->sched_block, target);
+    }
+}
+
+#if UTHREAD_LOCKING != UTHREAD_LOCK_NONE
+// Runs a worker's dispatch loop on a newly started kernel thread,
+// until the worker retires.
+static void* worker_main(void *arg)
+{
+    worker_t *worker = (worker_t *) arg;
+    current_worker = worker;
+    pin_worker(worker);
+    swapcontext(&worker->exit_context, worker->sched_block);
+
+    // The dispatch loop starts afresh if the worker is started again
+    *(void **) worker->sched_block = worker->free_blocks[DEFAULT_CLASS];
+    worker->free_blocks[DEFAULT_CLASS] = worker->sched_block;
+    worker->sched_block = NULL;
+    __atomic_sub_fetch(&scheduler.running, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&scheduler.retired, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&worker->retired, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Starts a kernel thread for the worker in the given slot. This
+// function returns 0 if succeeds, or -1 otherwise.
+static int run_worker(worker_t *worker)
+{
+    int running = __atomic_add_fetch(&scheduler.running, 1, __ATOMIC_SEQ_CST);
+    if (running > scheduler.peak_running)
+    {
+        __atomic_store_n(&scheduler.peak_running, running, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&scheduler.started, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&worker->pthread, NULL, worker_main, worker) != 0)
+    {
+        __atomic_sub_fetch(&scheduler.running, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    pthread_detach(worker->pthread);
+    return 0;
+}
+
+// The supervisor grows the pool of workers when threads are kept
+// waiting. Every SUPERVISE_US it looks at the run queues; if threads
+// were queued with no worker idle or spinning for SUPERVISE_TICKS
+// looks in a row, it starts another worker, up to max_workers. Workers
+// it starts retire themselves once they have been idle for the linger
+// time, and their slots are reused.
+
+// Returns the number of threads waiting in run queues, counting any
+// submitted ones as one.
+static long backlog()
+{
+    long queued = !mpsc_empty(&scheduler.inject);
+    int count = __atomic_load_n(&scheduler.nworkers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++)
+    {
+        worker_t *worker = &scheduler.workers[i];
+        unsigned levels = __atomic_load_n(&worker->summary.ready, __ATOMIC_ACQUIRE) |
+            __atomic_load_n(&worker->pinned_mask, __ATOMIC_ACQUIRE);
+        while (levels)
+        {
+            int level = __builtin_ctz(levels);
+            levels &= levels - 1;
+            long size = __atomic_load_n(&worker->runq[level].bottom, __ATOMIC_ACQUIRE) -
+                __atomic_load_n(&worker->runq[level].top, __ATOMIC_ACQUIRE);
+            queued += size > 0 ? size : 0;
+        }
+        queued += __atomic_load_n(&worker->runnext, __ATOMIC_ACQUIRE) != NULL;
+    }
+    return queued;
+}
+
+// Starts another worker in a retired slot, or a new one. This function
+// returns 0 if succeeds, or -1 otherwise.
+static int grow_workers()
+{
+    int count = __atomic_load_n(&scheduler.nworkers, __ATOMIC_ACQUIRE);
+    for (int i = 1; i < count; i++)
+    {
+        worker_t *worker = &scheduler.workers[i];
+        if (__atomic_load_n(&worker->retired, __ATOMIC_ACQUIRE))
+        {
+            worker->sched_block = make_block(worker, schedule, DEFAULT_CLASS);
+            if (!worker->sched_block)
+            {
+                return -1;
+            }
+            worker->retired = 0;
+            return run_worker(worker);
+        }
+    }
+    if (count == MAX_WORKERS)
+    {
+        return -1;
+    }
+
+    worker_t *worker = &scheduler.workers[count];
+    place_t *place = place_for(count);
+    if (place)
+    {
+        __atomic_store_n(&scheduler.nodes, count_nodes(places, count + 1), __ATOMIC_RELAXED);
+    }
+    if (init_worker(worker, count, place) != 0)
+    {
+        return -1;
+    }
+    worker->elastic = 1;
+    if (order_victims(count + 1) != 0)
+    {
+        return -1;
+    }
+    __atomic_store_n(&scheduler.nworkers, count + 1, __ATOMIC_RELEASE);
+    return run_worker(worker);
+}
+
+// The supervisor also looks for workers stuck in one thread, such as
+// one blocked in a system call, for longer than stall_ns while other
+// threads wait on their deques. It starts another worker in place of
+// each, which steals the waiting threads and later retires like any
+// other the supervisor starts. Threads pinned to the stuck worker's
+// shared stack have to wait for it. Once the stuck worker dispatches
+// another thread, it counts as running again.
+
+// Hands off every worker which has run the same thread for longer than
+// stall_ns while others wait on its deques.
+static void check_stalls()
+{
+    unsigned long long now = now_ns();
+    unsigned long long limit = __atomic_load_n(&scheduler.stall_ns, __ATOMIC_RELAXED);
+    int count = __atomic_load_n(&scheduler.nworkers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++)
+    {
+        worker_t *worker = &scheduler.workers[i];
+        unsigned long long dispatches = __atomic_load_n(&worker->dispatches, __ATOMIC_RELAXED);
+        if (dispatches != worker->seen_dispatches ||
+            !__atomic_load_n(&worker->active, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&worker->retired, __ATOMIC_ACQUIRE))
+        {
+            worker->seen_dispatches = dispatches;
+            worker->seen_at = now;
+            if (worker->stalled)
+            {
+                worker->stalled = 0;
+                __atomic_sub_fetch(&scheduler.stalled, 1, __ATOMIC_SEQ_CST);
+            }
+            continue;
+        }
+
+        if (!worker->stalled && now - worker->seen_at > limit &&
+            (__atomic_load_n(&worker->summary.ready, __ATOMIC_ACQUIRE) ||
+             __atomic_load_n(&worker->runnext, __ATOMIC_ACQUIRE)))
+        {
+            worker->stalled = 1;
+            __atomic_add_fetch(&scheduler.stalled, 1, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&scheduler.stalls, 1, __ATOMIC_RELAXED);
+            grow_workers();
+        }
+    }
+}
+
+// The supervisor's kernel thread.
+static void* supervise(void *arg)
+{
+    (void) arg;
+    int busy = 0;
+    for (;;)
+    {
+        usleep(SUPERVISE_US);
+        if (__atomic_load_n(&scheduler.stall_ns, __ATOMIC_RELAXED))
+        {
+            check_stalls();
+        }
+
+        if (backlog() > 0 && __atomic_load_n(&scheduler.idle_workers, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&scheduler.spinning, __ATOMIC_SEQ_CST) == 0)
+        {
+            busy++;
+        }
+        else
+        {
+            busy = 0;
+        }
+
+        if (busy >= SUPERVISE_TICKS &&
+            __atomic_load_n(&scheduler.running, __ATOMIC_SEQ_CST) -
+            __atomic_load_n(&scheduler.stalled, __ATOMIC_SEQ_CST) <
+            __atomic_load_n(&scheduler.max_workers, __ATOMIC_RELAXED))
+        {
+            grow_workers();
+            busy = 0;
+        }
+    }
+    return NULL;
+}
+
+// Starts the supervisor if it isn't running already. This function
+// returns 0 if succeeds, or -1 otherwise.
+static int start_supervisor()
+{
+    if (!scheduler.supervised)
+    {
+        pthread_t supervisor;
+        if (pthread_create(&supervisor, NULL, supervise, NULL) != 0)
+        {
+            return -1;
+        }
+        pthread_detach(supervisor);
+        scheduler.supervised = 1;
+    }
+    return 0;
+}
+#endif
+
+// Describes the machine to the scheduler in place of what it reads from
+// /sys. This function returns 0 if succeeds, or -1 otherwise.
+int uthread_set_topology(const uthread_place_t *given, int count)
+{
+#if UTHREAD_LOCKING == UTHREAD_LOCK_NONE
+    (void) given;
+    (void) count;
+    return -1;
+#else
+    if (!given || count < 1 || count > MAX_WORKERS || scheduler.nworkers != 1 ||
+        scheduler.supervised)
+    {
+        return -1;
+    }
+    memcpy(places, given, count * sizeof(place_t));
+    nplaces = count;
+    return 0;
+#endif
+}
+
+// Runs user-level threads on count kernel threads in total, counting
+// the one which called system_init. This function returns 0 if
+// succeeds, or -1 otherwise.
+int uthread_start_workers(int count)
+{
+#if UTHREAD_LOCKING == UTHREAD_LOCK_NONE
+    // Without a lock only one kernel thread may run the scheduler
+    (void) count;
+    return -1;
+#else
+    if (count < 1 || count > MAX_WORKERS || scheduler.nworkers != 1 || scheduler.supervised)
+    {
+        return -1;
+    }
+
+    // Pin workers only if each can have a CPU of its own
+    place_for(0);
+    scheduler.pin_workers = nplaces >= count;
+    if (scheduler.pin_workers)
+    {
+        __atomic_store_n(&scheduler.nodes, count_nodes(places, count), __ATOMIC_RELAXED);
+        set_place(&scheduler.workers[0], &places[0]);
+        pin_worker(&scheduler.workers[0]);
+    }
+    for (int i = 1; i < count; i++)
+    {
+        if (init_worker(&scheduler.workers[i], i, place_for(i)) != 0)
+        {
+            return -1;
+        }
+    }
+    if (order_victims(count) != 0)
+    {
+        return -1;
+    }
+
+    for (int i = 1; i < count; i++)
+    {
+        __atomic_store_n(&scheduler.nworkers, i + 1, __ATOMIC_RELEASE);
+        if (run_worker(&scheduler.workers[i]) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+#endif
+}
+
+// Lets the scheduler start more kernel threads, up to max_workers in
+// total, while threads are kept waiting, and retire those it started
+// once they have been idle for linger_ms milliseconds. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_set_elastic(int max_workers, unsigned linger_ms)
+{
+#if UTHREAD_LOCKING == UTHREAD_LOCK_NONE
+    (void) max_workers;
+    (void) linger_ms;
+    return -1;
+#else
+    if (max_workers < 1 || max_workers > MAX_WORKERS)
+    {
+        return -1;
+    }
+
+    __atomic_store_n(&scheduler.linger_ns, linger_ms * 1000000ULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&scheduler.max_workers, max_workers, __ATOMIC_RELAXED);
+    return start_supervisor();
+#endif
+}
+
+// Watches for kernel threads stuck running one user-level thread for
+// longer than stall_ms milliseconds while others wait for them, and
+// starts another kernel thread in place of each. This function returns
+// 0 if succeeds, or -1 otherwise.
+int uthread_set_stall_limit(unsigned stall_ms)
+{
+#if UTHREAD_LOCKING == UTHREAD_LOCK_NONE
+    (void) stall_ms;
+    return -1;
+#else
+    __atomic_store_n(&scheduler.stall_ns, stall_ms * 1000000ULL, __ATOMIC_RELAXED);
+    return start_supervisor();
+#endif
+}
+
+// Hands a thread to the scheduler from any kernel thread, waking a
+// worker to take it if none is spinning.
+static void inject(struct sched *sched, uthread_t *thread)
+{
+    mpsc_push(&sched->inject, thread);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched->idle_workers, __ATOMIC_SEQ_CST) > 0 &&
+        __atomic_load_n(&sched->spinning, __ATOMIC_SEQ_CST) == 0)
+    {
+        wake_one(&sched->workers[0]);
+    }
+}
+
+// Returns the scheduler, for handing to other kernel threads.
+uthread_sched_t* uthread_scheduler()
+{
+    return &scheduler;
+}
+
+// This function may be called from any kernel thread. It creates a
+// new user-level thread which runs fn(arg), with priority number
+// specified by argument priority, and hands it to the scheduler. This
+// function returns 0 if succeeds, or -1 otherwise.
+int uthread_submit(uthread_sched_t *sched, void (*fn)(void *), void *arg, int priority)
+{
+    uthread_t *thread = new_thread(priority);
+    if (!thread)
+    {
+        return -1;
+    }
+    thread->task = fn;
+    thread->arg = arg;
+
+    __atomic_add_fetch(&sched->live, 1, __ATOMIC_SEQ_CST);
+    inject(sched, thread);
+    return 0;
+}
+
+// Blocking calls are run by a pool of helper kernel threads, started
+// as they are needed up to max_helpers and kept from then on. The
+// calling thread is parked until its call returns, and its worker runs
+// other threads meanwhile. The helper then submits the thread back to
+// the scheduler like any other kernel thread would.
+static struct offload
+{
+    pthread_mutex_t mutex;  // Protects the rest
+    pthread_cond_t cond;    // Signalled when a call is queued
+    list_t calls;           // Threads whose calls are waiting for a helper
+    int helpers;            // Helpers started
+    int idle;               // Helpers waiting for a call, not yet woken
+    int wakeups;            // Wakeups signalled and not yet taken
+    int max_helpers;        // Most helpers to start
+} helpers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { NULL, NULL }, 0, 0, 0, MAX_HELPERS };
+
+// A helper kernel thread. It runs queued calls one after another.
+static void* helper_main(void *arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&helpers.mutex);
+    for (;;)
+    {
+        uthread_t *thread = list_pop(&helpers.calls);
+        if (!thread)
+        {
+            helpers.idle++;
+            while (helpers.wakeups == 0)
+            {
+                pthread_cond_wait(&helpers.cond, &helpers.mutex);
+            }
+            helpers.wakeups--;
+            continue;
+        }
+        pthread_mutex_unlock(&helpers.mutex);
+
+        thread->extra->blocking(thread->extra->blocking_arg);
+        wait_end(thread);
+        wait_begin(thread, UTHREAD_WAIT_PREEMPTED);
+        inject(&scheduler, thread);
+
+        pthread_mutex_lock(&helpers.mutex);
+    }
+    return NULL;
+}
+
+// Runs the thread's blocking call on a helper kernel thread, then puts
+// the thread back on a run queue.
+static void offload(uthread_t *thread)
+{
+    pthread_mutex_lock(&helpers.mutex);
+    list_push(&helpers.calls, thread);
+
+    // The helper is claimed here rather than when it wakes, so that a
+    // second call made before then starts another helper
+    if (helpers.idle > 0)
+    {
+        helpers.idle--;
+        helpers.wakeups++;
+        pthread_cond_signal(&helpers.cond);
+    }
+    else if (helpers.helpers < helpers.max_helpers)
+    {
+        pthread_t helper;
+        if (pthread_create(&helper, NULL, helper_main, NULL) == 0)
+        {
+            pthread_detach(helper);
+            helpers.helpers++;
+        }
+        else if (helpers.helpers == 0)
+        {
+            perror("uthread: helper");
+            exit(1);
+        }
+    }
+    pthread_mutex_unlock(&helpers.mutex);
+}
+
+// Runs fn(arg) on a helper kernel thread, parking the calling
+// user-level thread until it returns. Other user-level threads run in
+// the meantime, and the caller is then queued again at its priority.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_run_blocking(void (*fn)(void *), void *arg)
+{
+    worker_t *worker = current();
+    uthread_t *save = worker ? worker->active : NULL;
+    if (!save)
+    {
+        fn(arg);
+        return 0;
+    }
+
+    // A task has to be given a stack before it can be switched away from
+    thread_extra_t *extra = extra_of(save);
+    if (!extra || (is_task(save) && promote_task(worker, save) != 0))
+    {
+        return -1;
+    }
+    extra->blocking = fn;
+    extra->blocking_arg = arg;
+
+    // Whoever runs next hands the call to a helper once our context is
+    // saved, so the helper can't queue us before then
+    wait_begin(save, UTHREAD_WAIT_IO);
+    switch_away(worker, save, SWITCH_BLOCK);
+    cancel_point(save);
+
+    return 0;
+}
+
+// Sets the most helper kernel threads uthread_run_blocking may use.
+// Calls beyond that many at once wait for a helper to be free.
+void uthread_set_blocking_threads(int max_helpers)
+{
+    pthread_mutex_lock(&helpers.mutex);
+    helpers.max_helpers = max_helpers > 0 ? max_helpers : 1;
+    pthread_mutex_unlock(&helpers.mutex);
+}
+
+// Sets how idle kernel threads wait for work. At most max_spinners of
+// them, or half of them if max_spinners is negative, poll for new work
+// for spin_us microseconds before parking; the rest park straight away.
+void uthread_set_spinning(int max_spinners, unsigned spin_us)
+{
+    __atomic_store_n(&scheduler.max_spinners, max_spinners, __ATOMIC_RELAXED);
+    __atomic_store_n(&scheduler.spin_ns, spin_us * 1000ULL, __ATOMIC_RELAXED);
+}
+
+// Fills in stats with the scheduler's counters so far, summed over all
+// workers.
+void uthread_get_stats(uthread_stats_t *stats)
+{
+    memset(stats, 0, sizeof(uthread_stats_t));
+    stats->workers = __atomic_load_n(&scheduler.running, __ATOMIC_ACQUIRE);
+    stats->peak_workers = __atomic_load_n(&scheduler.peak_running, __ATOMIC_RELAXED);
+    stats->workers_started = __atomic_load_n(&scheduler.started, __ATOMIC_RELAXED);
+    stats->workers_retired = __atomic_load_n(&scheduler.retired, __ATOMIC_RELAXED);
+    stats->stalls = __atomic_load_n(&scheduler.stalls, __ATOMIC_RELAXED);
+    stats->nodes = __atomic_load_n(&scheduler.nodes, __ATOMIC_RELAXED);
+    int count = __atomic_load_n(&scheduler.nworkers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++)
+    {
+        worker_t *worker = &scheduler.workers[i];
+        stats->steals += __atomic_load_n(&worker->steals, __ATOMIC_RELAXED);
+        stats->remote_steals += __atomic_load_n(&worker->remote_steals, __ATOMIC_RELAXED);
+    }
+}
+
+// Keeps the scheduler running while it has nothing to do, so that the
+// calling kernel thread can go on submitting threads to it.
+void uthread_sched_ref(uthread_sched_t *sched)
+{
+    __atomic_add_fetch(&sched->refs, 1, __ATOMIC_SEQ_CST);
+}
+
+// Drops a reference taken by uthread_sched_ref. The scheduler ends the
+// process as usual once it has no threads and no references.
+void uthread_sched_unref(uthread_sched_t *sched)
+{
+    if (__atomic_sub_fetch(&sched->refs, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        wake_one(&sched->workers[0]);
+    }
+}
+
+// Names the calling user-level thread. Off-CPU time is aggregated
+// per name, so threads doing the same job should share a name.
+void uthread_set_name(const char *name)
+{
+    worker_t *worker = current();
+    uthread_t *thread = worker ? worker->active : NULL;
+    if (!thread || !extra_of(thread))
+    {
+        return;
+    }
+
+    lock_acquire(&lock);
+    name_stats_t *stats = find_stats(name);
+    if (!stats)
+    {
+        stats = (name_stats_t *) calloc(1, sizeof(name_stats_t));
+        if (!stats)
+        {
+            lock_release(&lock);
+            return;
+        }
+        strncpy(stats->name, name, NAME_SIZE - 1);
+        stats->next = unnamed_stats.next;
+        unnamed_stats.next = stats;
+    }
+    thread->extra->stats = stats;
+    lock_release(&lock);
+}
+
+// Returns the total off-CPU time in nanoseconds charged to the given
+// wait reason by threads with the given name, or by all threads if
+// name is NULL.
+unsigned long long uthread_offcpu_time(int reason, const char *name)
+{
+    if (reason < 0 || reason >= UTHREAD_WAIT_REASONS)
+    {
+        return 0;
+    }
+    if (!name)
+    {
+        return __atomic_load_n(&offcpu_total[reason], __ATOMIC_RELAXED);
+    }
+
+    lock_acquire(&lock);
+    name_stats_t *stats = find_stats(name);
+    lock_release(&lock);
+    return stats ? __atomic_load_n(&stats->offcpu[reason], __ATOMIC_RELAXED) : 0;
+}
+
+// Writes the aggregate off-CPU time per wait reason and per thread
+// name to out.
+void uthread_offcpu_report(FILE *out)
+{
+    static const char *reasons[UTHREAD_WAIT_REASONS] =
+        { "preempted", "mutex", "io", "sync" };
+
+    fprintf(out, "%-24s", "off-CPU ms");
+    for (int i = 0; i < UTHREAD_WAIT_REASONS; i++)
+    {
+        fprintf(out, " %12s", reasons[i]);
+    }
+    fprintf(out, "\n%-24s", "(all)");
+    for (int i = 0; i < UTHREAD_WAIT_REASONS; i++)
+    {
+        fprintf(out, " %12.3f", __atomic_load_n(&offcpu_total[i], __ATOMIC_RELAXED) / 1e6);
+    }
+    fprintf(out, "\n");
+
+    lock_acquire(&lock);
+    for (name_stats_t *curr = &unnamed_stats; curr; curr = curr->next)
+    {
+        fprintf(out, "%-24s", curr->name);
+        for (int i = 0; i < UTHREAD_WAIT_REASONS; i++)
+        {
+            fprintf(out, " %12.3f", __atomic_load_n(&curr->offcpu[i], __ATOMIC_RELAXED) / 1e6);
+        }
+        fprintf(out, "\n");
+    }
+    lock_release(&lock);
+}
+
+// Turns stack painting on or off. While it is on, every new stack is
+// filled with a pattern so that each thread's stack high-water mark
+// can be measured when it exits, and later threads running the same
+// function get a larger stack size class if they needed more than the
+// default.
+void uthread_set_stack_painting(int enable)
+{
+    stack_painting = enable;
+}
+
+// Turns stack shrinking on or off. While it is on, threads running a
+// function measured with stack painting may get a stack smaller than
+// the default, though never smaller than 8 KB and always with 4 KB to
+// spare beyond half again the deepest measured run.
+void uthread_set_stack_shrinking(int enable)
+{
+    stack_shrinking = enable;
+}
+
+// Returns the deepest stack use in bytes measured for threads running
+// func(), or 0 if none have run on a painted stack.
+size_t uthread_stack_high_water(void func())
+{
+    lock_acquire(&lock);
+    stack_stats_t *stats = find_stack_stats(func);
+    size_t high_water = stats ? stats->high_water : 0;
+    lock_release(&lock);
+    return high_water;
+}
+
+// Writes the measured stack high-water mark and the stack size picked
+// for every function that has run on a painted stack to out.
+void uthread_stack_report(FILE *out)
+{
+    fprintf(out, "%-18s %10s %12s %12s\n", "function", "runs", "high water", "stack size");
+    lock_acquire(&lock);
+    for (int i = 0; i < STACK_STATS_BUCKETS; i++)
+    {
+        for (stack_stats_t *curr = stack_stats[i]; curr; curr = curr->next)
+        {
+            fprintf(out, "%-18p %10lu %12zu %12zu\n", (void *) curr->func, curr->runs,
+                    curr->high_water, class_size(fit_stack_class(curr)));
+        }
+    }
+    lock_release(&lock);
+}
+
+// Allocates size bytes, 16-byte aligned, from the calling thread's
+// arena. The memory stays valid until the thread exits, and is freed
+// with the rest of the arena then. Returns NULL if the thread wasn't
+// created with UTHREAD_ARENA, if size is more than an arena block can
+// hold, or if no memory could be allocated.
+void* uthread_alloc(size_t size)
+{
+    worker_t *worker = current();
+    uthread_t *thread = worker ? worker->active : NULL;
+    if (!thread || !(thread->flags & UTHREAD_ARENA) || size > ARENA_SIZE - ARENA_HEADER)
+    {
+        return NULL;
+    }
+
+    thread_extra_t *extra = extra_of(thread);
+    size = (size + 15) & ~(size_t) 15;
+    if (!extra || (size > extra->arena_left && add_arena(worker, thread) != 0))
+    {
+        return NULL;
+    }
+    void *memory = extra->arena_next;
+    extra->arena_next += size;
+    extra->arena_left -= size;
+    return memory;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                        Synchronization                          //
+/////////////////////////////////////////////////////////////////////
+
+
+// Appends the thread to the queue. The queue's guard must be held.
+static void waitq_push(uthread_waitq_t *queue, uthread_t *thread)
+{
+    thread->next = NULL;
+    if (queue->tail)
+    {
+        queue->tail->next = thread;
+    }
+    else
+    {
+        queue->head = thread;
+    }
+    queue->tail = thread;
+}
+
+// A thread's cancelled field has CANCEL_ASKED set once uthread_cancel
+// is called on it, and CANCEL_WOKEN as well if that took it out of a
+// cancellable wait rather than the primitive waking it.
+#define CANCEL_ASKED 1
+#define CANCEL_WOKEN 2
+
+// Appends the running thread to the queue and switches away from it.
+// The lock guarding the queue must be held; it is usually the queue's
+// own, but primitives with several queues guard them all with one.
+// The lock is released once the thread's context is saved, so whoever
+// wakes it can't run it before then. A cancellable wait is a
+// cancellation point, and uthread_cancel takes the thread back out of
+// the queue; waits whose primitive would be left inconsistent by that
+// aren't cancellable, and nor are waits guarded by a lock other than
+// the queue's own. The time until the thread is woken is charged to
+// the given wait reason. Returns 0 once the thread is woken, or -1 with
+// the lock released if the caller is not a user-level thread or is a
+// task which could not be given a stack.
+static int park_on(uthread_waitq_t *queue, int *lock, int cancellable, int reason)
+{
+    worker_t *worker = current();
+    uthread_t *save = worker ? worker->active : NULL;
+    if (!save || (is_task(save) && promote_task(worker, save) != 0))
+    {
+        waitq_release(lock);
+        return -1;
+    }
+
+    // uthread_cancel sets the flag before looking for the queue, and we
+    // publish the queue before checking the flag, so one of us sees the
+    // other
+    if (cancellable)
+    {
+        __atomic_store_n(&save->wait_queue, queue, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&save->cancelled, __ATOMIC_SEQ_CST))
+        {
+            save->wait_queue = NULL;
+            waitq_release(lock);
+            cancel_point(save);
+        }
+    }
+
+    waitq_push(queue, save);
+    wait_begin(save, reason);
+    worker->park_lock = lock;
+    switch_away(worker, save, SWITCH_PARK);
+
+    // A thread woken by the primitive goes on, so what it was handed
+    // isn't lost; one taken out of the queue by uthread_cancel unwinds
+    if (cancellable && (__atomic_load_n(&save->cancelled, __ATOMIC_ACQUIRE) & CANCEL_WOKEN))
+    {
+        cancel_point(save);
+    }
+    return 0;
+}
+
+// Detaches the first n threads of the queue, or all of them if n is
+// negative, and returns them as a list in the order they parked. The
+// queue's lock must be held.
+static uthread_t* waitq_take(uthread_waitq_t *queue, int n)
+{
+    uthread_t *head = queue->head;
+    uthread_t *last = NULL;
+    uthread_t *curr = head;
+    while (curr && n != 0)
+    {
+        __atomic_store_n(&curr->wait_queue, NULL, __ATOMIC_RELAXED);
+        last = curr;
+        curr = curr->next;
+        n--;
+    }
+    if (!last)
+    {
+        return NULL;
+    }
+
+    last->next = NULL;
+    queue->head = curr;
+    if (!curr)
+    {
+        queue->tail = NULL;
+    }
+    return head;
+}
+
+// Makes a list of threads taken from a wait queue ready. A single
+// thread woken by a running one may run next on its worker. A batch
+// goes straight onto the run queues in order, and idle workers are
+// told about it once rather than once per thread. Threads released
+// from a kernel thread the library doesn't run on are handed over the
+// way uthread_submit does it.
+static void release_waiters(uthread_t *threads)
+{
+    worker_t *worker = current();
+    if (!worker)
+    {
+        while (threads)
+        {
+            uthread_t *next = threads->next;
+            wait_end(threads);
+            wait_begin(threads, UTHREAD_WAIT_PREEMPTED);
+            inject(&scheduler, threads);
+            threads = next;
+        }
+        return;
+    }
+    if (threads && !threads->next)
+    {
+        wake(threads);
+        return;
+    }
+
+    int queued = 0;
+    while (threads)
+    {
+        uthread_t *next = threads->next;
+        if (threads->home)
+        {
+            ready(threads);
+        }
+        else
+        {
+            wait_end(threads);
+            wait_begin(threads, UTHREAD_WAIT_PREEMPTED);
+            __atomic_store_n(&threads->queued, 1, __ATOMIC_RELEASE);
+            push_ready(worker, level_of(threads->priority), threads);
+            queued = 1;
+        }
+        threads = next;
+    }
+    if (queued)
+    {
+        notify_idle(worker);
+    }
+}
+
+// Initializes an empty wait queue.
+static void waitq_init(uthread_waitq_t *queue)
+{
+    queue->lock = 0;
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+// Initializes the semaphore with count permits. This function returns
+// 0 if succeeds, or -1 otherwise.
+int uthread_sem_init(uthread_sem_t *sem, int count)
+{
+    if (count < 0)
+    {
+        return -1;
+    }
+    waitq_init(&sem->waiters);
+    sem->count = count;
+    return 0;
+}
+
+// Takes a permit from the semaphore, parking the calling thread until
+// one is posted if there are none. This function returns 0 if
+// succeeds, or -1 otherwise.
+int uthread_sem_wait(uthread_sem_t *sem)
+{
+    waitq_acquire(&sem->waiters.lock);
+    if (sem->count > 0)
+    {
+        sem->count--;
+        waitq_release(&sem->waiters.lock);
+        return 0;
+    }
+
+    // A post hands its permit straight to the thread it wakes
+    return park_on(&sem->waiters, &sem->waiters.lock, 1, UTHREAD_WAIT_SYNC);
+}
+
+// Takes a permit from the semaphore if one is free. This function
+// returns 0 if succeeds, or -1 if there were none.
+int uthread_sem_trywait(uthread_sem_t *sem)
+{
+    int result = -1;
+    waitq_acquire(&sem->waiters.lock);
+    if (sem->count > 0)
+    {
+        sem->count--;
+        result = 0;
+    }
+    waitq_release(&sem->waiters.lock);
+    return result;
+}
+
+// Adds n permits to the semaphore, waking up to n waiting threads in
+// the order they waited. This function returns 0 if succeeds, or -1
+// otherwise.
+int uthread_sem_post_n(uthread_sem_t *sem, int n)
+{
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    waitq_acquire(&sem->waiters.lock);
+    uthread_t *woken = waitq_take(&sem->waiters, n);
+    for (uthread_t *curr = woken; curr; curr = curr->next)
+    {
+        n--;
+    }
+    sem->count += n;
+    waitq_release(&sem->waiters.lock);
+
+    release_waiters(woken);
+    return 0;
+}
+
+// Adds a permit to the semaphore, waking the longest waiting thread if
+// there is one. This function returns 0 if succeeds, or -1 otherwise.
+int uthread_sem_post(uthread_sem_t *sem)
+{
+    return uthread_sem_post_n(sem, 1);
+}
+
+// Initializes a barrier for count threads. This function returns 0 if
+// succeeds, or -1 otherwise.
+int uthread_barrier_init(uthread_barrier_t *barrier, int count)
+{
+    if (count <= 0)
+    {
+        return -1;
+    }
+    waitq_init(&barrier->waiters);
+    barrier->count = count;
+    barrier->arrived = 0;
+    return 0;
+}
+
+// Parks the calling thread until count threads have called this, then
+// releases them all at once. The barrier can then be used again. This
+// function returns 1 in the last thread to arrive, 0 in the others, or
+// -1 if it fails.
+int uthread_barrier_wait(uthread_barrier_t *barrier)
+{
+    waitq_acquire(&barrier->waiters.lock);
+    if (++barrier->arrived < barrier->count)
+    {
+        int result = park_on(&barrier->waiters, &barrier->waiters.lock, 0, UTHREAD_WAIT_SYNC);
+        if (result != 0)
+        {
+            waitq_acquire(&barrier->waiters.lock);
+            barrier->arrived--;
+            waitq_release(&barrier->waiters.lock);
+        }
+        return result;
+    }
+
+    // The waiters are detached before unlocking, so threads arriving
+    // for the next round queue up behind a fresh count
+    barrier->arrived = 0;
+    uthread_t *woken = waitq_take(&barrier->waiters, -1);
+    waitq_release(&barrier->waiters.lock);
+
+    release_waiters(woken);
+    return 1;
+}
+
+// Initializes a latch which opens after count calls to
+// uthread_latch_count_down. This function returns 0 if succeeds, or -1
+// otherwise.
+int uthread_latch_init(uthread_latch_t *latch, int count)
+{
+    if (count < 0)
+    {
+        return -1;
+    }
+    waitq_init(&latch->waiters);
+    latch->count = count;
+    return 0;
+}
+
+// Counts the latch down by one, opening it and releasing every waiting
+// thread when it reaches zero. Counting down an open latch does
+// nothing.
+void uthread_latch_count_down(uthread_latch_t *latch)
+{
+    uthread_t *woken = NULL;
+    waitq_acquire(&latch->waiters.lock);
+    if (latch->count > 0 && --latch->count == 0)
+    {
+        woken = waitq_take(&latch->waiters, -1);
+    }
+    waitq_release(&latch->waiters.lock);
+
+    release_waiters(woken);
+}
+
+// Parks the calling thread until the latch is open. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_latch_wait(uthread_latch_t *latch)
+{
+    waitq_acquire(&latch->waiters.lock);
+    if (latch->count == 0)
+    {
+        waitq_release(&latch->waiters.lock);
+        return 0;
+    }
+    return park_on(&latch->waiters, &latch->waiters.lock, 1, UTHREAD_WAIT_SYNC);
+}
+
+// Initializes a wait group with nothing to wait for.
+void uthread_wg_init(uthread_wg_t *wg)
+{
+    waitq_init(&wg->waiters);
+    wg->count = 0;
+}
+
+// Adds delta, which may be negative, to the number of pieces of work
+// the group waits for. Waiting threads are released when it reaches
+// zero. This function returns 0 if succeeds, or -1 if the count would
+// go below zero.
+int uthread_wg_add(uthread_wg_t *wg, int delta)
+{
+    uthread_t *woken = NULL;
+    waitq_acquire(&wg->waiters.lock);
+    if (wg->count + delta < 0)
+    {
+        waitq_release(&wg->waiters.lock);
+        return -1;
+    }
+    wg->count += delta;
+    if (wg->count == 0)
+    {
+        woken = waitq_take(&wg->waiters, -1);
+    }
+    waitq_release(&wg->waiters.lock);
+
+    release_waiters(woken);
+    return 0;
+}
+
+// Marks one piece of work of the group as done. This function returns
+// 0 if succeeds, or -1 if there was none outstanding.
+int uthread_wg_done(uthread_wg_t *wg)
+{
+    return uthread_wg_add(wg, -1);
+}
+
+// Parks the calling thread until the group has no work outstanding.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_wg_wait(uthread_wg_t *wg)
+{
+    waitq_acquire(&wg->waiters.lock);
+    if (wg->count == 0)
+    {
+        waitq_release(&wg->waiters.lock);
+        return 0;
+    }
+    return park_on(&wg->waiters, &wg->waiters.lock, 1, UTHREAD_WAIT_SYNC);
+}
+
+// A count of readers on a cache line of its own. Readers count
+// themselves in the slot of the worker they run on, so that readers on
+// different workers don't bounce one line between them. A reader which
+// moves to another worker while holding the lock leaves one slot high
+// and another low; only the sum means anything.
+struct uthread_read_count
+{
+    long count;             // Readers in, less readers out, on this worker
+} __attribute__((aligned(64)));
+
+// Returns the slot the calling kernel thread counts readers in.
+static struct uthread_read_count* read_slot(uthread_rwlock_t *rwlock)
+{
+    worker_t *worker = current();
+    return &rwlock->counts[worker ? worker->id : 0];
+}
+
+// Returns the number of readers holding the lock, or about to find a
+// writer has it and back out.
+static long count_readers(uthread_rwlock_t *rwlock)
+{
+    long sum = 0;
+    for (int i = 0; i < MAX_WORKERS; i++)
+    {
+        sum += __atomic_load_n(&rwlock->counts[i].count, __ATOMIC_SEQ_CST);
+    }
+    return sum;
+}
+
+// Returns the writer waiting for readers to leave, taken off its
+// queue, if there is one and the last reader has left. The lock's
+// guard must be held.
+static uthread_t* drained_writer(uthread_rwlock_t *rwlock)
+{
+    if (rwlock->drain.head && count_readers(rwlock) == 0)
+    {
+        return waitq_take(&rwlock->drain, -1);
+    }
+    return NULL;
+}
+
+// Initializes an unlocked reader-writer lock. This function returns 0
+// if succeeds, or -1 otherwise.
+int uthread_rwlock_init(uthread_rwlock_t *rwlock)
+{
+    size_t size = MAX_WORKERS * sizeof(struct uthread_read_count);
+    rwlock->counts = (struct uthread_read_count *) aligned_alloc(64, size);
+    if (!rwlock->counts)
+    {
+        return -1;
+    }
+    memset(rwlock->counts, 0, size);
+
+    waitq_init(&rwlock->readers);
+    waitq_init(&rwlock->writers);
+    waitq_init(&rwlock->drain);
+    rwlock->writer = 0;
+    return 0;
+}
+
+// Frees the memory held by an unlocked reader-writer lock.
+void uthread_rwlock_destroy(uthread_rwlock_t *rwlock)
+{
+    free(rwlock->counts);
+    rwlock->counts = NULL;
+}
+
+// Takes the lock for reading, parking the calling thread while a
+// writer holds it or is waiting for it. When no writer is about this
+// is a single atomic add to a counter of the caller's worker. This
+// function returns 0 if succeeds, or -1 otherwise.
+int uthread_rwlock_rdlock(uthread_rwlock_t *rwlock)
+{
+    int *guard = &rwlock->readers.lock;
+    while (1)
+    {
+        // A writer sets its flag before counting readers, and we count
+        // ourselves before checking the flag, so one of us sees the other
+        struct uthread_read_count *slot = read_slot(rwlock);
+        __atomic_add_fetch(&slot->count, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&rwlock->writer, __ATOMIC_SEQ_CST))
+        {
+            return 0;
+        }
+
+        // Back out, waking the writer if it was only waiting for us, and
+        // wait for the writer to hand the lock to the parked readers
+        __atomic_sub_fetch(&slot->count, 1, __ATOMIC_SEQ_CST);
+        waitq_acquire(guard);
+        release_waiters(drained_writer(rwlock));
+        if (rwlock->writer)
+        {
+            return park_on(&rwlock->readers, guard, 0, UTHREAD_WAIT_MUTEX);
+        }
+        waitq_release(guard);
+    }
+}
+
+// Releases the lock taken for reading. The last reader out wakes a
+// writer waiting for the lock.
+void uthread_rwlock_rdunlock(uthread_rwlock_t *rwlock)
+{
+    __atomic_sub_fetch(&read_slot(rwlock)->count, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&rwlock->writer, __ATOMIC_SEQ_CST))
+    {
+        return;
+    }
+
+    waitq_acquire(&rwlock->readers.lock);
+    uthread_t *writer = drained_writer(rwlock);
+    waitq_release(&rwlock->readers.lock);
+    release_waiters(writer);
+}
+
+// Releases the lock taken for writing. Every parked reader is let in
+// at once, counted on the caller's worker before they run. The next
+// waiting writer is handed the lock as soon as they have left, and new
+// readers queue behind it meanwhile, so writers aren't starved.
+void uthread_rwlock_wrunlock(uthread_rwlock_t *rwlock)
+{
+    waitq_acquire(&rwlock->readers.lock);
+    uthread_t *readers = waitq_take(&rwlock->readers, -1);
+    long count = 0;
+    for (uthread_t *curr = readers; curr; curr = curr->next)
+    {
+        count++;
+    }
+    if (count)
+    {
+        __atomic_add_fetch(&read_slot(rwlock)->count, count, __ATOMIC_SEQ_CST);
+    }
+
+    uthread_t *writer = waitq_take(&rwlock->writers, 1);
+    if (!writer)
+    {
+        __atomic_store_n(&rwlock->writer, 0, __ATOMIC_SEQ_CST);
+    }
+    else if (count_readers(rwlock) != 0)
+    {
+        waitq_push(&rwlock->drain, writer);
+        writer = NULL;
+    }
+    waitq_release(&rwlock->readers.lock);
+
+    release_waiters(readers);
+    release_waiters(writer);
+}
+
+// Takes the lock for writing, parking the calling thread until no
+// other writer or reader holds it. This function returns 0 if
+// succeeds, or -1 otherwise.
+int uthread_rwlock_wrlock(uthread_rwlock_t *rwlock)
+{
+    int *guard = &rwlock->readers.lock;
+    waitq_acquire(guard);
+    if (rwlock->writer)
+    {
+        // The writer before us hands the lock over when it unlocks
+        return park_on(&rwlock->writers, guard, 0, UTHREAD_WAIT_MUTEX);
+    }
+
+    __atomic_store_n(&rwlock->writer, 1, __ATOMIC_SEQ_CST);
+    if (count_readers(rwlock) == 0)
+    {
+        waitq_release(guard);
+        return 0;
+    }
+
+    // The last reader out wakes us
+    if (park_on(&rwlock->drain, guard, 0, UTHREAD_WAIT_MUTEX) != 0)
+    {
+        uthread_rwlock_wrunlock(rwlock);
+        return -1;
+    }
+    return 0;
+}
+
+// Priority inheritance mutexes share one lock, which guards their wait
+// queues and every boost. A boost has to see the waiters of all the
+// mutexes the holder has, so per-mutex locks would have to be taken
+// together; the lock is only taken when a mutex is contended.
+static int pi_lock;
+
+// Inserts the thread into the queue behind every thread at least as
+// urgent. The queue's guard must be held.
+static void waitq_insert(uthread_waitq_t *queue, uthread_t *thread)
+{
+    uthread_t **link = &queue->head;
+    while (*link && (*link)->priority <= thread->priority)
+    {
+        link = &(*link)->next;
+    }
+    thread->next = *link;
+    *link = thread;
+    if (!thread->next)
+    {
+        queue->tail = thread;
+    }
+}
+
+// Sets the thread's priority to the most urgent of its own and that of
+// the first waiter on every mutex it holds. A thread raised while it
+// is queued gets another entry at its new level, since digging it out
+// of the deque it is in would need the owner's cooperation; whichever
+// entry is found first runs it. A pinned thread is moved between its
+// worker's pinned queues instead. pi_lock must be held.
+static void pi_recompute(uthread_t *thread)
+{
+    int priority = __atomic_load_n(&thread->base_priority, __ATOMIC_SEQ_CST);
+    for (uthread_mutex_t *curr = thread->pi_held; curr; curr = curr->held_next)
+    {
+        if (curr->waiters.head && curr->waiters.head->priority < priority)
+        {
+            priority = curr->waiters.head->priority;
+        }
+    }
+
+    int old = thread->priority;
+    __atomic_store_n(&thread->priority, priority, __ATOMIC_SEQ_CST);
+    int level = level_of(priority);
+    if (level >= level_of(old))
+    {
+        return;
+    }
+    if (thread->home)
+    {
+        repin(thread->home, thread, level);
+        return;
+    }
+    if (!__atomic_load_n(&thread->queued, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    // If the thread is claimed meanwhile, the new entry is dropped when
+    // it is found
+    __atomic_add_fetch(&thread->refs, 1, __ATOMIC_RELAXED);
+    worker_t *worker = current();
+    push_ready(worker, level, thread);
+    notify_idle(worker);
+}
+
+// Sets the priority the thread asks for, keeping any boost from
+// waiters on mutexes it holds. A waiter publishes itself in pi_held
+// before reading the base priority, and we write the base priority
+// before reading pi_held, so one of us sees the other.
+static void set_priority(uthread_t *thread, int priority)
+{
+    __atomic_store_n(&thread->base_priority, priority, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&thread->priority, priority, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&thread->pi_held, __ATOMIC_SEQ_CST))
+    {
+        waitq_acquire(&pi_lock);
+        pi_recompute(thread);
+        waitq_release(&pi_lock);
+    }
+}
+
+// Initializes an unlocked priority inheritance mutex.
+void uthread_mutex_init(uthread_mutex_t *mutex)
+{
+    waitq_init(&mutex->waiters);
+    mutex->owner = 0;
+    mutex->held_next = NULL;
+    mutex->spin_ns = MUTEX_SPIN_NS;
+}
+
+// Returns whether the thread is running on some worker. The thread is
+// only compared against, never read, since it may have exited.
+static int is_running(uthread_t *thread)
+{
+    int count = __atomic_load_n(&scheduler.nworkers, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++)
+    {
+        if (__atomic_load_n(&scheduler.workers[i].active, __ATOMIC_RELAXED) == thread)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Parking a waiter and queueing it again costs more than a short hold
+// of the mutex, so while its holder is running on another worker a
+// waiter spins for it instead, for up to twice the average time spins
+// on the mutex have taken to succeed. Spins that run out of budget
+// shrink the average, so a mutex held for long stops being spun on.
+// Spinners never take the mutex from a parked waiter, since it is
+// handed straight over while any are parked. Returns 0 if the mutex
+// was taken, or -1 if the caller should park.
+static int spin_for_mutex(uthread_mutex_t *mutex, uthread_t *self)
+{
+    if (__atomic_load_n(&scheduler.nworkers, __ATOMIC_RELAXED) < 2)
+    {
+        return -1;
+    }
+
+    int average = __atomic_load_n(&mutex->spin_ns, __ATOMIC_RELAXED);
+    unsigned long long budget = 2ULL * average;
+    budget = budget < MUTEX_SPIN_MIN_NS ? MUTEX_SPIN_MIN_NS : budget;
+    budget = budget > MUTEX_SPIN_MAX_NS ? MUTEX_SPIN_MAX_NS : budget;
+    unsigned long long start = now_ns();
+    for (int spins = 1; ; spins++)
+    {
+        uintptr_t owner = __atomic_load_n(&mutex->owner, __ATOMIC_RELAXED);
+        if (!owner)
+        {
+            if (__atomic_compare_exchange_n(&mutex->owner, &owner, (uintptr_t) self, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                int took = now_ns() - start;
+                __atomic_store_n(&mutex->spin_ns, average + (took - average) / 8,
+                                 __ATOMIC_RELAXED);
+                return 0;
+            }
+            continue;
+        }
+        if (spins % MUTEX_SPIN_CHECK == 0 &&
+            (now_ns() - start > budget || !is_running((uthread_t *) (owner & ~(uintptr_t) 1))))
+        {
+            break;
+        }
+        cpu_relax();
+    }
+
+    __atomic_store_n(&mutex->spin_ns, average - average / 8, __ATOMIC_RELAXED);
+    return -1;
+}
+
+// Takes the mutex, parking the calling thread until it is free. While
+// it waits, the holder runs at the waiter's priority if that is more
+// urgent than its own. This function returns 0 if succeeds, or -1
+// otherwise.
+int uthread_mutex_lock(uthread_mutex_t *mutex)
+{
+    worker_t *worker = current();
+    uthread_t *self = worker ? worker->active : NULL;
+    if (!self)
+    {
+        return -1;
+    }
+    uintptr_t expected = 0;
+    if (__atomic_compare_exchange_n(&mutex->owner, &expected, (uintptr_t) self, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+
+    if (spin_for_mutex(mutex, self) == 0)
+    {
+        return 0;
+    }
+
+    // A task has to be given a stack before it can park
+    if (is_task(self) && promote_task(worker, self) != 0)
+    {
+        return -1;
+    }
+
+    // Mark the mutex contended, so that the holder's unlock comes here
+    // for the lock rather than just clearing the owner
+    waitq_acquire(&pi_lock);
+    while (1)
+    {
+        uintptr_t owner = __atomic_load_n(&mutex->owner, __ATOMIC_ACQUIRE);
+        uintptr_t want = owner ? owner | 1 : (uintptr_t) self;
+        if ((owner & 1) ||
+            __atomic_compare_exchange_n(&mutex->owner, &owner, want, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            if (!owner)
+            {
+                waitq_release(&pi_lock);
+                return 0;
+            }
+            break;
+        }
+    }
+
+    uthread_t *holder = (uthread_t *) (mutex->owner & ~(uintptr_t) 1);
+    if (!mutex->waiters.head)
+    {
+        mutex->held_next = holder->pi_held;
+        __atomic_store_n(&holder->pi_held, mutex, __ATOMIC_SEQ_CST);
+    }
+    waitq_insert(&mutex->waiters, self);
+    pi_recompute(holder);
+
+    // The unlocking thread hands the mutex straight to us
+    wait_begin(self, UTHREAD_WAIT_MUTEX);
+    worker->park_lock = &pi_lock;
+    switch_away(worker, self, SWITCH_PARK);
+    return 0;
+}
+
+// Takes the mutex if it is free. This function returns 0 if succeeds,
+// or -1 otherwise.
+int uthread_mutex_trylock(uthread_mutex_t *mutex)
+{
+    worker_t *worker = current();
+    uthread_t *self = worker ? worker->active : NULL;
+    uintptr_t expected = 0;
+    if (!self || !__atomic_compare_exchange_n(&mutex->owner, &expected, (uintptr_t) self, 0,
+                                              __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Releases the mutex held by the calling thread, handing it to the
+// most urgent waiter. The caller drops back to the priority it asked
+// for, or to that of waiters on other mutexes it still holds. This
+// function returns 0 if succeeds, or -1 if the caller did not hold it.
+int uthread_mutex_unlock(uthread_mutex_t *mutex)
+{
+    worker_t *worker = current();
+    uthread_t *self = worker ? worker->active : NULL;
+    uintptr_t expected = (uintptr_t) self;
+    if (!self)
+    {
+        return -1;
+    }
+    if (__atomic_compare_exchange_n(&mutex->owner, &expected, 0, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    if ((expected & ~(uintptr_t) 1) != (uintptr_t) self)
+    {
+        return -1;
+    }
+
+    waitq_acquire(&pi_lock);
+    uthread_mutex_t **link = &self->pi_held;
+    while (*link != mutex)
+    {
+        link = &(*link)->held_next;
+    }
+    __atomic_store_n(link, mutex->held_next, __ATOMIC_SEQ_CST);
+
+    uthread_t *next = waitq_take(&mutex->waiters, 1);
+    if (mutex->waiters.head)
+    {
+        mutex->held_next = next->pi_held;
+        __atomic_store_n(&next->pi_held, mutex, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&mutex->owner, (uintptr_t) next | 1, __ATOMIC_RELEASE);
+        pi_recompute(next);
+    }
+    else
+    {
+        __atomic_store_n(&mutex->owner, (uintptr_t) next, __ATOMIC_RELEASE);
+    }
+    pi_recompute(self);
+    waitq_release(&pi_lock);
+
+    wake(next);
+    return 0;
+}
+
+// The parking lot holds threads waiting on any address, so that a lock
+// or flag can be a single byte with no queue of its own. Addresses hash
+// to a fixed set of buckets, each with its own lock and a queue of the
+// threads parked on any address landing there.
+typedef struct park_bucket
+{
+    uthread_waitq_t queue;  // Threads parked on addresses in this bucket
+} __attribute__((aligned(64))) park_bucket_t;
+
+static park_bucket_t parking_lot[1 << PARK_BITS];
+
+// Returns the bucket holding threads parked on the address.
+static park_bucket_t* bucket_of(const void *addr)
+{
+    unsigned long long hash = (uintptr_t) addr * 0x9e3779b97f4a7c15ULL;
+    return &parking_lot[hash >> (64 - PARK_BITS)];
+}
+
+// Parks the calling thread on addr as uthread_park does, charging the
+// time until it is unparked to the given wait reason.
+static int park_at(const void *addr, int (*validate)(void *), void *arg, int reason)
+{
+    worker_t *worker = current();
+    uthread_t *self = worker ? worker->active : NULL;
+    if (!self)
+    {
+        return -1;
+    }
+
+    park_bucket_t *bucket = bucket_of(addr);
+    waitq_acquire(&bucket->queue.lock);
+    if (validate && !validate(arg))
+    {
+        waitq_release(&bucket->queue.lock);
+        return -1;
+    }
+    self->park_addr = addr;
+    return park_on(&bucket->queue, &bucket->queue.lock, 1, reason);
+}
+
+// Parks the calling thread on addr, unless validate(arg) returns 0.
+// validate is called with the bucket locked, so an unpark on addr
+// can't slip in between it and the thread parking. This function
+// returns 0 once the thread has been unparked, or -1 if it didn't
+// park.
+int uthread_park(const void *addr, int (*validate)(void *), void *arg)
+{
+    return park_at(addr, validate, arg, UTHREAD_WAIT_SYNC);
+}
+
+// Unparks the thread which has waited longest on addr, if there is
+// one. If callback isn't NULL, it is called with the bucket still
+// locked, with whether more threads are parked on addr, so the caller
+// can update its word before anyone else parks on it. Returns the
+// number of threads unparked.
+int uthread_unpark_one(const void *addr, void (*callback)(void *, int), void *arg)
+{
+    park_bucket_t *bucket = bucket_of(addr);
+    waitq_acquire(&bucket->queue.lock);
+    uthread_t **link = &bucket->queue.head;
+    uthread_t *prev = NULL;
+    while (*link && (*link)->park_addr != addr)
+    {
+        prev = *link;
+        link = &prev->next;
+    }
+
+    uthread_t *thread = *link;
+    int more = 0;
+    if (thread)
+    {
+        *link = thread->next;
+        __atomic_store_n(&thread->wait_queue, NULL, __ATOMIC_RELAXED);
+        if (bucket->queue.tail == thread)
+        {
+            bucket->queue.tail = prev;
+        }
+        thread->next = NULL;
+        for (uthread_t *curr = *link; curr && !more; curr = curr->next)
+        {
+            more = curr->park_addr == addr;
+        }
+    }
+    if (callback)
+    {
+        callback(arg, more);
+    }
+    waitq_release(&bucket->queue.lock);
+
+    release_waiters(thread);
+    return thread ? 1 : 0;
+}
+
+// Unparks every thread parked on addr, in one batch. Returns the number
+// of threads unparked.
+int uthread_unpark_all(const void *addr)
+{
+    park_bucket_t *bucket = bucket_of(addr);
+    uthread_t *woken = NULL;
+    uthread_t **woken_tail = &woken;
+    int count = 0;
+
+    waitq_acquire(&bucket->queue.lock);
+    uthread_t **link = &bucket->queue.head;
+    uthread_t *prev = NULL;
+    while (*link)
+    {
+        uthread_t *curr = *link;
+        if (curr->park_addr != addr)
+        {
+            prev = curr;
+            link = &curr->next;
+            continue;
+        }
+        *link = curr->next;
+        curr->next = NULL;
+        __atomic_store_n(&curr->wait_queue, NULL, __ATOMIC_RELAXED);
+        *woken_tail = curr;
+        woken_tail = &curr->next;
+        count++;
+    }
+    bucket->queue.tail = prev;
+    waitq_release(&bucket->queue.lock);
+
+    release_waiters(woken);
+    return count;
+}
+
+// A byte lock keeps whether it is held in one bit and whether threads
+// may be parked on it in another. Unlocking doesn't hand the lock over:
+// the unparked thread competes for it again, so a thread that takes
+// and drops the lock in a loop doesn't switch on every round.
+#define BYTELOCK_HELD 1
+#define BYTELOCK_PARKED 2
+
+// Parks only if the lock is still held with threads parked on it.
+static int bytelock_validate(void *arg)
+{
+    return __atomic_load_n((uthread_bytelock_t *) arg, __ATOMIC_RELAXED) ==
+           (BYTELOCK_HELD | BYTELOCK_PARKED);
+}
+
+// Leaves the parked bit set if other threads are still parked.
+static void bytelock_unparked(void *arg, int more)
+{
+    __atomic_store_n((uthread_bytelock_t *) arg, more ? BYTELOCK_PARKED : 0, __ATOMIC_RELEASE);
+}
+
+// Takes the byte lock, parking the calling thread until it is free.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_bytelock_acquire(uthread_bytelock_t *lock)
+{
+    unsigned char state = 0;
+    if (__atomic_compare_exchange_n(lock, &state, BYTELOCK_HELD, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    if (!current() || !current()->active)
+    {
+        return -1;
+    }
+
+    while (1)
+    {
+        state = __atomic_load_n(lock, __ATOMIC_RELAXED);
+        if (!(state & BYTELOCK_HELD))
+        {
+            if (__atomic_compare_exchange_n(lock, &state, state | BYTELOCK_HELD, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                return 0;
+            }
+            continue;
+        }
+        if (!(state & BYTELOCK_PARKED) &&
+            !__atomic_compare_exchange_n(lock, &state, state | BYTELOCK_PARKED, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+        park_at(lock, bytelock_validate, lock, UTHREAD_WAIT_MUTEX);
+    }
+}
+
+// Releases the byte lock, unparking one thread waiting for it.
+void uthread_bytelock_release(uthread_bytelock_t *lock)
+{
+    unsigned char state = BYTELOCK_HELD;
+    if (__atomic_compare_exchange_n(lock, &state, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    uthread_unpark_one(lock, bytelock_unparked, lock);
+}
+
+// A once flag goes from new to running, to running with threads parked
+// on it, to done.
+#define ONCE_NEW 0
+#define ONCE_RUNNING 1
+#define ONCE_PARKED 2
+#define ONCE_DONE 3
+
+// Parks only if the function is still running with threads parked.
+static int once_validate(void *arg)
+{
+    return __atomic_load_n((uthread_once_t *) arg, __ATOMIC_RELAXED) == ONCE_PARKED;
+}
+
+// Calls fn() if no thread has called it through the flag yet, and
+// otherwise parks the calling thread until that call has returned.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_once(uthread_once_t *once, void (*fn)())
+{
+    unsigned char state = __atomic_load_n(once, __ATOMIC_ACQUIRE);
+    if (state == ONCE_DONE)
+    {
+        return 0;
+    }
+
+    state = ONCE_NEW;
+    if (__atomic_compare_exchange_n(once, &state, ONCE_RUNNING, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+        fn();
+        if (__atomic_exchange_n(once, ONCE_DONE, __ATOMIC_ACQ_REL) == ONCE_PARKED)
+        {
+            uthread_unpark_all(once);
+        }
+        return 0;
+    }
+    if (!current() || !current()->active)
+    {
+        return -1;
+    }
+
+    while (state != ONCE_DONE)
+    {
+        if (state == ONCE_RUNNING &&
+            !__atomic_compare_exchange_n(once, &state, ONCE_PARKED, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+        uthread_park(once, once_validate, once);
+        state = __atomic_load_n(once, __ATOMIC_ACQUIRE);
+    }
+    return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                     Thread-local storage                        //
+/////////////////////////////////////////////////////////////////////
+
+
+// Each thread holds its values inline, indexed by key, so a lookup is
+// a load of the running thread and one of its slots. Keys are handed
+// out from a fixed table of destructors. A key goes from free to
+// claimed while its destructor is written or cleared, and is only in
+// use once that is done, so whoever sees it in use sees its destructor.
+#define KEY_FREE 0
+#define KEY_CLAIMED 1
+#define KEY_USED 2
+
+static int key_used[UTHREAD_KEYS_MAX];
+static void (*key_destructors[UTHREAD_KEYS_MAX])(void *);
+
+// Runs the destructors of the thread's thread-local values. Destructors
+// may set values again, so this goes round a few times.
+static void run_destructors(uthread_t *thread)
+{
+    for (int round = 0; round < KEY_DESTRUCTOR_ROUNDS; round++)
+    {
+        int ran = 0;
+        for (int key = 0; key < UTHREAD_KEYS_MAX; key++)
+        {
+            void *value = thread->specific[key];
+            thread->specific[key] = NULL;
+            if (!value || __atomic_load_n(&key_used[key], __ATOMIC_ACQUIRE) != KEY_USED)
+            {
+                continue;
+            }
+            void (*destructor)(void *) = __atomic_load_n(&key_destructors[key], __ATOMIC_RELAXED);
+            if (destructor)
+            {
+                destructor(value);
+                ran = 1;
+            }
+        }
+        if (!ran)
+        {
+            return;
+        }
+    }
+}
+
+// Creates a thread-local key, whose value starts as NULL in every
+// thread. When a thread exits with a value other than NULL for the
+// key, destructor is called with it, unless destructor is NULL. This
+// function returns 0 if succeeds, or -1 if there are no keys left.
+int uthread_key_create(uthread_key_t *key, void (*destructor)(void *))
+{
+    for (int i = 0; i < UTHREAD_KEYS_MAX; i++)
+    {
+        int state = KEY_FREE;
+        if (__atomic_load_n(&key_used[i], __ATOMIC_RELAXED) == KEY_FREE &&
+            __atomic_compare_exchange_n(&key_used[i], &state, KEY_CLAIMED, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&key_destructors[i], destructor, __ATOMIC_RELAXED);
+            __atomic_store_n(&key_used[i], KEY_USED, __ATOMIC_RELEASE);
+            *key = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Deletes a thread-local key. Values threads still hold for it are
+// neither freed nor cleared. This function returns 0 if succeeds, or
+// -1 otherwise.
+int uthread_key_delete(uthread_key_t key)
+{
+    int state = KEY_USED;
+    if (key >= UTHREAD_KEYS_MAX ||
+        !__atomic_compare_exchange_n(&key_used[key], &state, KEY_CLAIMED, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return -1;
+    }
+    __atomic_store_n(&key_destructors[key], NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&key_used[key], KEY_FREE, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Returns the calling thread's value for the key, or NULL if it has
+// none or is not a user-level thread.
+void* uthread_getspecific(uthread_key_t key)
+{
+    worker_t *worker = current();
+    uthread_t *thread = worker ? worker->active : NULL;
+    return thread && key < UTHREAD_KEYS_MAX ? thread->specific[key] : NULL;
+}
+
+// Sets the calling thread's value for the key. This function returns 0
+// if succeeds, or -1 otherwise.
+int uthread_setspecific(uthread_key_t key, const void *value)
+{
+    worker_t *worker = current();
+    uthread_t *thread = worker ? worker->active : NULL;
+    if (!thread || key >= UTHREAD_KEYS_MAX)
+    {
+        return -1;
+    }
+    thread->specific[key] = (void *) value;
+    return 0;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                          Cancellation                           //
+/////////////////////////////////////////////////////////////////////
+
+
+// A cancelled thread carries on until it reaches a cancellation point:
+// uthread_yield, a cancellable wait, the return from
+// uthread_run_blocking, uthread_testcancel, or starting to run. There
+// it runs its cleanup handlers, newest first, and exits, which runs
+// its thread-local destructors and returns its stack to the pool. A
+// thread in a cancellable wait is taken out of the queue and woken so
+// that it gets there at once.
+
+// Unwinds the thread if it has been cancelled.
+static void cancel_point(uthread_t *thread)
+{
+    if (!thread || !__atomic_load_n(&thread->cancelled, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    thread_extra_t *extra = thread->extra;
+    while (extra && extra->cleanup)
+    {
+        uthread_cleanup_t *cleanup = extra->cleanup;
+        extra->cleanup = cleanup->prev;
+        cleanup->fn(cleanup->arg);
+    }
+    uthread_exit();
+}
+
+// This function creates a new user-level thread which runs fn(arg)
+// like uthread_spawn_task, and returns a handle to it, or NULL if it
+// fails. The handle stays valid after the thread exits, until it is
+// given to uthread_release.
+uthread_t* uthread_spawn(void (*fn)(void *), void *arg, int priority)
+{
+    uthread_t *thread = new_thread(priority);
+    if (!thread)
+    {
+        return NULL;
+    }
+    thread->task = fn;
+    thread->arg = arg;
+    thread->stackless = 1;
+    thread->refs = 2;
+
+    __atomic_add_fetch(&scheduler.live, 1, __ATOMIC_SEQ_CST);
+    enqueue(thread);
+    return thread;
+}
+
+// Drops a handle returned by uthread_spawn.
+void uthread_release(uthread_t *thread)
+{
+    put_node(thread);
+}
+
+// Asks the thread to stop at its next cancellation point, waking it if
+// it is in a cancellable wait. Cancelling a thread which has exited
+// does nothing.
+void uthread_cancel(uthread_t *thread)
+{
+    __atomic_or_fetch(&thread->cancelled, CANCEL_ASKED, __ATOMIC_SEQ_CST);
+    uthread_waitq_t *queue = __atomic_load_n(&thread->wait_queue, __ATOMIC_SEQ_CST);
+    if (!queue)
+    {
+        return;
+    }
+
+    // The thread's wait queue only changes with the queue's lock held,
+    // so if it still names the queue the thread is parked in it
+    waitq_acquire(&queue->lock);
+    if (__atomic_load_n(&thread->wait_queue, __ATOMIC_RELAXED) != queue)
+    {
+        waitq_release(&queue->lock);
+        return;
+    }
+    uthread_t **link = &queue->head;
+    uthread_t *prev = NULL;
+    while (*link != thread)
+    {
+        prev = *link;
+        link = &prev->next;
+    }
+    *link = thread->next;
+    if (queue->tail == thread)
+    {
+        queue->tail = prev;
+    }
+    thread->next = NULL;
+    __atomic_or_fetch(&thread->cancelled, CANCEL_WOKEN, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread->wait_queue, NULL, __ATOMIC_RELAXED);
+    waitq_release(&queue->lock);
+
+    release_waiters(thread);
+}
+
+// Unwinds the calling thread if it has been cancelled.
+void uthread_testcancel()
+{
+    worker_t *worker = current();
+    cancel_point(worker ? worker->active : NULL);
+}
+
+// Registers cleanup->fn(arg) to be run if the calling thread is
+// cancelled before the matching uthread_cleanup_pop. cleanup is
+// storage for the registration, usually on the caller's stack.
+void uthread_cleanup_push(uthread_cleanup_t *cleanup, void (*fn)(void *), void *arg)
+{
+    worker_t *worker = current();
+    uthread_t *thread = worker ? worker->active : NULL;
+    cleanup->fn = fn;
+    cleanup->arg = arg;
+    cleanup->prev = NULL;
+    if (!thread)
+    {
+        return;
+    }
+    if (!extra_of(thread))
+    {
+        fprintf(stderr, "uthread: unable to register a cleanup handler\n");
+        exit(1);
+    }
+    cleanup->prev = thread->extra->cleanup;
+    thread->extra->cleanup = cleanup;
+}
+
+// Removes the newest cleanup handler of the calling thread, running it
+// first if execute is not 0.
+void uthread_cleanup_pop(int execute)
+{
+    worker_t *worker = current();
+    uthread_t *thread = worker ? worker->active : NULL;
+    uthread_cleanup_t *cleanup = thread && thread->extra ? thread->extra->cleanup : NULL;
+    if (!cleanup)
+    {
+        return;
+    }
+    thread->extra->cleanup = cleanup->prev;
+    if (execute)
+    {
+        cleanup->fn(cleanup->arg);
+    }
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                          Task groups                            //
+/////////////////////////////////////////////////////////////////////
+
+
+// A group's members are tasks whose nodes come from slabs of
+// GROUP_SLAB nodes owned by the group, so spawning many of them
+// doesn't go through malloc. A member counts as pending until its node
+// is released, which is the last the library does with it, so once
+// uthread_group_wait returns nothing touches the group. The group's
+// lock guards the slab, the running members and the counts.
+struct uthread_group_slab
+{
+    struct uthread_group_slab *next;    // Slab allocated before this one
+    uthread_t nodes[GROUP_SLAB];        // Nodes for members
+    thread_extra_t extras[GROUP_SLAB];  // Extra state of each node
+};
+
+// Returns a group member's node to its group's slab once the member
+// has finished with it, waking the group's waiters if it was the last.
+static void group_release(uthread_t *thread)
+{
+    thread_extra_t *extra = thread->extra;
+    uthread_group_t *group = extra->group;
+    waitq_acquire(&group->waiters.lock);
+    if (extra->group_prev)
+    {
+        extra->group_prev->extra->group_next = extra->group_next;
+    }
+    else
+    {
+        group->running = extra->group_next;
+    }
+    if (extra->group_next)
+    {
+        extra->group_next->extra->group_prev = extra->group_prev;
+    }
+    thread->next = group->free_nodes;
+    group->free_nodes = thread;
+
+    uthread_t *woken = NULL;
+    if (--group->pending == 0)
+    {
+        woken = waitq_take(&group->waiters, -1);
+    }
+    waitq_release(&group->waiters.lock);
+
+    release_waiters(woken);
+}
+
+// Cancels every running member of the group, and any spawned into it
+// later. uthread_cancel takes the lock of the queue a member waits on,
+// and the last put_node of a member takes the group's lock, so the
+// members are only collected under the group's lock, each with a
+// reference that keeps it in the list, and are cancelled once it has
+// been dropped. Members spawned meanwhile go in front of those
+// collected, and see the group cancelled.
+static void group_cancel(uthread_group_t *group)
+{
+    waitq_acquire(&group->waiters.lock);
+    group->cancelled = 1;
+    uthread_t *members = group->running;
+    for (uthread_t *curr = members; curr; curr = curr->extra->group_next)
+    {
+        __atomic_add_fetch(&curr->refs, 1, __ATOMIC_RELAXED);
+    }
+    waitq_release(&group->waiters.lock);
+
+    while (members)
+    {
+        uthread_t *next = members->extra->group_next;
+        uthread_cancel(members);
+        put_node(members);
+        members = next;
+    }
+}
+
+// Runs a group member, cancelling the rest of the group if it fails.
+static void group_main(void *arg)
+{
+    uthread_t *self = current()->active;
+    int result = self->extra->group_fn(arg);
+    if (result != 0)
+    {
+        uthread_group_t *group = self->extra->group;
+        waitq_acquire(&group->waiters.lock);
+        int first = !group->error;
+        if (first)
+        {
+            group->error = result;
+        }
+        waitq_release(&group->waiters.lock);
+        if (first)
+        {
+            group_cancel(group);
+        }
+    }
+}
+
+// Initializes an empty group.
+void uthread_group_init(uthread_group_t *group)
+{
+    waitq_init(&group->waiters);
+    group->pending = 0;
+    group->error = 0;
+    group->cancelled = 0;
+    group->running = NULL;
+    group->free_nodes = NULL;
+    group->slabs = NULL;
+}
+
+// Creates a member of the group, a task which runs fn(arg) with the
+// given priority. If it returns anything but 0, the first such result
+// is kept for uthread_group_wait and the rest of the group is
+// cancelled. This function returns 0 if succeeds, or -1 otherwise.
+int uthread_group_spawn(uthread_group_t *group, int (*fn)(void *), void *arg, int priority)
+{
+    waitq_acquire(&group->waiters.lock);
+    if (!group->free_nodes)
+    {
+        struct uthread_group_slab *slab =
+            (struct uthread_group_slab *) malloc(sizeof(struct uthread_group_slab));
+        if (!slab)
+        {
+            waitq_release(&group->waiters.lock);
+            return -1;
+        }
+        slab->next = group->slabs;
+        group->slabs = slab;
+        for (int i = 0; i < GROUP_SLAB; i++)
+        {
+            slab->nodes[i].next = i + 1 < GROUP_SLAB ? &slab->nodes[i + 1] : NULL;
+            slab->nodes[i].extra = &slab->extras[i];
+        }
+        group->free_nodes = &slab->nodes[0];
+    }
+    uthread_t *thread = group->free_nodes;
+    group->free_nodes = thread->next;
+
+    thread_extra_t *extra = thread->extra;
+    init_thread(thread, priority);
+    memset(extra, 0, sizeof(thread_extra_t));
+    thread->extra = extra;
+    thread->task = group_main;
+    thread->arg = arg;
+    thread->stackless = 1;
+    extra->group = group;
+    extra->group_fn = fn;
+    extra->group_prev = NULL;
+    extra->group_next = group->running;
+    if (group->running)
+    {
+        group->running->extra->group_prev = thread;
+    }
+    group->running = thread;
+    group->pending++;
+    if (group->cancelled)
+    {
+        thread->cancelled = CANCEL_ASKED;
+    }
+    waitq_release(&group->waiters.lock);
+
+    __atomic_add_fetch(&scheduler.live, 1, __ATOMIC_SEQ_CST);
+    enqueue(thread);
+    return 0;
+}
+
+// Parks the calling thread until every member of the group has
+// finished. If the caller has been cancelled, the members are cancelled
+// and waited for before it unwinds. Returns the first result other
+// than 0 a member returned, 0 if there was none, or -1 if the caller
+// is not a user-level thread.
+int uthread_group_wait(uthread_group_t *group)
+{
+    worker_t *worker = current();
+    uthread_t *self = worker ? worker->active : NULL;
+    if (self && __atomic_load_n(&self->cancelled, __ATOMIC_ACQUIRE))
+    {
+        group_cancel(group);
+    }
+    waitq_acquire(&group->waiters.lock);
+    if (group->pending == 0)
+    {
+        waitq_release(&group->waiters.lock);
+    }
+    else if (park_on(&group->waiters, &group->waiters.lock, 0, UTHREAD_WAIT_SYNC) != 0)
+    {
+        return -1;
+    }
+
+    cancel_point(self);
+    return group->error;
+}
+
+// Cancels every member of the group which is still running, and any
+// spawned into it later.
+void uthread_group_cancel(uthread_group_t *group)
+{
+    group_cancel(group);
+}
+
+// Frees the group's slabs. The group must have no members left, as
+// after uthread_group_wait.
+void uthread_group_destroy(uthread_group_t *group)
+{
+    while (group->slabs)
+    {
+        struct uthread_group_slab *next = group->slabs->next;
+        free(group->slabs);
+        group->slabs = next;
+    }
+    group->free_nodes = NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                     Futures and promises                        //
+/////////////////////////////////////////////////////////////////////
+
+
+// Besides the threads parked in uthread_future_get, a future keeps a
+// list of watches, which are told the value as the promise is set,
+// with the future's lock still held. Continuations and the combinators
+// are watches. Holding the lock means that once someone takes the lock
+// and finds their watch still on the list, it hasn't been and won't be
+// called, so it can be taken off and freed. A continuation whose task
+// can't be created is run by the setter instead, once it has dropped
+// the lock.
+struct uthread_watch
+{
+    int (*notify)(struct uthread_watch *watch, void *value);   // Called when the promise is set
+    struct uthread_watch *next;         // Next watch on the same future
+};
+
+// A continuation added with uthread_future_then.
+typedef struct then_watch
+{
+    struct uthread_watch watch;
+    void (*fn)(void *, void *);         // Continuation
+    void *arg;                          // Argument passed to fn after the value
+    int priority;                       // Priority of the task running fn
+    void *value;                        // Value of the future, once set
+} then_watch_t;
+
+// A thread in uthread_when_all or uthread_when_any, waiting for the
+// futures it is watching.
+typedef struct join
+{
+    uthread_waitq_t waiter;             // Its lock guards the rest of the join
+    int remaining;                      // Futures not yet set, for when_all
+    int first;                          // Index of the first future set, for when_any
+} join_t;
+
+// A watch of one of the futures of a join.
+typedef struct join_watch
+{
+    struct uthread_watch watch;
+    join_t *join;                       // Join the watch belongs to
+    int index;                          // Index of the watched future
+} join_watch_t;
+
+// Runs a continuation, as a task unless its task couldn't be created.
+static void then_main(void *arg)
+{
+    then_watch_t *then = (then_watch_t *) arg;
+    then->fn(then->value, then->arg);
+    free(then);
+}
+
+// Initializes a promise which is not yet set.
+void uthread_promise_init(uthread_promise_t *promise)
+{
+    uthread_future_t *future = &promise->future;
+    waitq_init(&future->waiters);
+    future->ready = 0;
+    future->value = NULL;
+    future->watches = NULL;
+}
+
+// Returns the future whose value the promise sets.
+uthread_future_t* uthread_promise_future(uthread_promise_t *promise)
+{
+    return &promise->future;
+}
+
+// Sets the promise's value, waking every thread waiting for it in one
+// batch and starting its continuations. A continuation whose task
+// can't be created runs in the caller before this returns. This may be
+// called from any kernel thread. This function returns 0 if succeeds,
+// or -1 if the promise was already set.
+int uthread_promise_set(uthread_promise_t *promise, void *value)
+{
+    uthread_future_t *future = &promise->future;
+    waitq_acquire(&future->waiters.lock);
+    if (future->ready)
+    {
+        waitq_release(&future->waiters.lock);
+        return -1;
+    }
+    future->value = value;
+    __atomic_store_n(&future->ready, 1, __ATOMIC_RELEASE);
+    uthread_t *woken = waitq_take(&future->waiters, -1);
+
+    struct uthread_watch *watch = future->watches;
+    struct uthread_watch *failed = NULL;
+    future->watches = NULL;
+    while (watch)
+    {
+        struct uthread_watch *next = watch->next;
+        if (watch->notify(watch, value) != 0)
+        {
+            watch->next = failed;
+            failed = watch;
+        }
+        watch = next;
+    }
+    waitq_release(&future->waiters.lock);
+
+    release_waiters(woken);
+    while (failed)
+    {
+        struct uthread_watch *next = failed->next;
+        then_main(failed);
+        failed = next;
+    }
+    return 0;
+}
+
+// Returns whether the future's value has been set.
+int uthread_future_ready(uthread_future_t *future)
+{
+    return __atomic_load_n(&future->ready, __ATOMIC_ACQUIRE);
+}
+
+// Stores the future's value in *value, parking the calling thread
+// until it is set. A future which is already set is read without
+// taking any lock. This is a cancellation point. This function returns
+// 0 if succeeds, or -1 otherwise.
+int uthread_future_get(uthread_future_t *future, void **value)
+{
+    if (!__atomic_load_n(&future->ready, __ATOMIC_ACQUIRE))
+    {
+        waitq_acquire(&future->waiters.lock);
+        if (future->ready)
+        {
+            waitq_release(&future->waiters.lock);
+        }
+        else if (park_on(&future->waiters, &future->waiters.lock, 1, UTHREAD_WAIT_SYNC) != 0)
+        {
+            return -1;
+        }
+    }
+    *value = future->value;
+    return 0;
+}
+
+// Starts the continuation's task, from whichever kernel thread set the
+// promise. Returns -1 if the task couldn't be created, leaving the
+// continuation for the setter to run.
+static int then_notify(struct uthread_watch *watch, void *value)
+{
+    then_watch_t *then = (then_watch_t *) watch;
+    then->value = value;
+    if (current())
+    {
+        return uthread_spawn_task(then_main, then, then->priority);
+    }
+    return uthread_submit(&scheduler, then_main, then, then->priority);
+}
+
+// Arranges for fn(value, arg) to run as a task with the given priority
+// once the future's value is set, or straight away if it already is.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_future_then(uthread_future_t *future, void (*fn)(void *, void *), void *arg,
+                        int priority)
+{
+    then_watch_t *then = (then_watch_t *) malloc(sizeof(then_watch_t));
+    if (!then)
+    {
+        return -1;
+    }
+    then->watch.notify = then_notify;
+    then->fn = fn;
+    then->arg = arg;
+    then->priority = priority;
+
+    waitq_acquire(&future->waiters.lock);
+    if (!future->ready)
+    {
+        then->watch.next = future->watches;
+        future->watches = &then->watch;
+        waitq_release(&future->waiters.lock);
+        return 0;
+    }
+    waitq_release(&future->waiters.lock);
+
+    then->value = future->value;
+    if (uthread_spawn_task(then_main, then, priority) != 0)
+    {
+        free(then);
+        return -1;
+    }
+    return 0;
+}
+
+// Counts a future of a join as set, waking its thread when that is the
+// last one it needs. The future's lock is held, and the join's is
+// taken inside it.
+static int join_notify(struct uthread_watch *watch, void *value)
+{
+    join_watch_t *entry = (join_watch_t *) watch;
+    join_t *join = entry->join;
+    (void) value;
+
+    waitq_acquire(&join->waiter.lock);
+    uthread_t *woken = NULL;
+    if (join->first < 0)
+    {
+        join->first = entry->index;
+    }
+    if (--join->remaining == 0)
+    {
+        woken = waitq_take(&join->waiter, -1);
+    }
+    waitq_release(&join->waiter.lock);
+    release_waiters(woken);
+    return 0;
+}
+
+// Parks the calling thread once until needed of the futures are set. A
+// watch goes on every future that isn't set yet, and is taken off
+// again afterwards if it is still there. Returns the index of the first future
+// found set, or -1 if the caller is not a user-level thread or memory
+// ran out.
+static int join_futures(uthread_future_t **futures, int count, int needed)
+{
+    worker_t *worker = current();
+    uthread_t *self = worker ? worker->active : NULL;
+    if (!self || (is_task(self) && promote_task(worker, self) != 0))
+    {
+        return -1;
+    }
+    join_watch_t *entries = (join_watch_t *) malloc(count * sizeof(join_watch_t));
+    if (!entries)
+    {
+        return -1;
+    }
+
+    join_t join;
+    waitq_init(&join.waiter);
+    join.remaining = needed;
+    join.first = -1;
+    for (int i = 0; i < count; i++)
+    {
+        entries[i].watch.notify = join_notify;
+        entries[i].watch.next = NULL;
+        entries[i].join = &join;
+        entries[i].index = i;
+
+        uthread_future_t *future = futures[i];
+        waitq_acquire(&future->waiters.lock);
+        if (future->ready)
+        {
+            join_notify(&entries[i].watch, future->value);
+        }
+        else
+        {
+            entries[i].watch.next = future->watches;
+            future->watches = &entries[i].watch;
+        }
+        waitq_release(&future->waiters.lock);
+    }
+
+    // The caller was checked above, so parking can't fail
+    waitq_acquire(&join.waiter.lock);
+    if (join.remaining > 0)
+    {
+        park_on(&join.waiter, &join.waiter.lock, 0, UTHREAD_WAIT_SYNC);
+    }
+    else
+    {
+        waitq_release(&join.waiter.lock);
+    }
+
+    // Take off the watches of futures which weren't set
+    for (int i = 0; i < count; i++)
+    {
+        uthread_future_t *future = futures[i];
+        waitq_acquire(&future->waiters.lock);
+        struct uthread_watch **link = &future->watches;
+        while (*link && *link != &entries[i].watch)
+        {
+            link = &(*link)->next;
+        }
+        if (*link)
+        {
+            *link = entries[i].watch.next;
+        }
+        waitq_release(&future->waiters.lock);
+    }
+    free(entries);
+    return join.first;
+}
+
+// Parks the calling thread until every one of the count futures is
+// set. This function returns 0 if succeeds, or -1 otherwise.
+int uthread_when_all(uthread_future_t **futures, int count)
+{
+    int i = 0;
+    while (i < count && uthread_future_ready(futures[i]))
+    {
+        i++;
+    }
+    if (i == count)
+    {
+        return 0;
+    }
+    return join_futures(futures, count, count) < 0 ? -1 : 0;
+}
+
+// Parks the calling thread until any of the count futures is set.
+// Returns the index of a future which is set, or -1 if it fails.
+int uthread_when_any(uthread_future_t **futures, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (uthread_future_ready(futures[i]))
+        {
+            return i;
+        }
+    }
+    return count > 0 ? join_futures(futures, count, 1) : -1;
+}
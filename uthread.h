@@ -1,3 +1,7 @@
+#include <stdio.h>
+#include <stdint.h>
+
+
 /////////////////////////////////////////////////////////////////////
 //                     Library API prototypes                      //
 /////////////////////////////////////////////////////////////////////
@@ -7,11 +11,26 @@
 // functions can be called. It initializes the uthread system.
 void system_init();
 
+// Lower priority numbers run first. Priorities below 0 are treated as
+// 0, and those of UTHREAD_PRIORITY_LEVELS or more as the last level.
+#define UTHREAD_PRIORITY_LEVELS 32
+
 // This function creates a new user-level thread which runs func(),
 // with priority number specified by argument priority. This function
 // returns 0 if succeeds, or -1 otherwise.
 int uthread_create(void func(), int priority);
 
+// Flags for uthread_create_flags.
+#define UTHREAD_SHARED_STACK 0x1    // Run on the scheduler's shared stack, keeping
+                                    // only the used part while switched away
+#define UTHREAD_ARENA 0x2           // Give the thread an arena for uthread_alloc,
+                                    // freed all at once when it exits
+
+// This function creates a new user-level thread like uthread_create,
+// with the UTHREAD_* options given by argument flags. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_create_flags(void func(), int priority, int flags);
+
 // The calling thread requests to yield the kernel thread that
 // it is currently running to one of other user threads which
 // has the highest priority level among the ready threads if
@@ -23,3 +42,611 @@ int uthread_yield(int priority);
 
 // The calling user-level thread ends its execution.
 void uthread_exit();
+
+// This function queues fn(arg) as a task with priority number
+// specified by argument priority. A task shares the run queue with
+// user-level threads but runs to completion on the scheduler's own
+// stack; it is only given a stack of its own if it yields. This
+// function returns 0 if succeeds, or -1 otherwise.
+int uthread_spawn_task(void (*fn)(void *), void *arg, int priority);
+
+// Allocates size bytes, 16-byte aligned, from the calling thread's
+// arena. There is no way to free the memory by itself; the whole arena
+// is freed when the thread exits. Returns NULL if the thread wasn't
+// created with UTHREAD_ARENA, if size is more than 64 KB less a few
+// bytes, or if no memory could be allocated.
+void* uthread_alloc(size_t size);
+
+
+/////////////////////////////////////////////////////////////////////
+//              Submitting from other kernel threads               //
+/////////////////////////////////////////////////////////////////////
+
+
+// The functions above may only be called from user-level threads. To
+// hand work to the scheduler from another kernel thread, such as a
+// network acceptor, use uthread_submit.
+typedef struct sched uthread_sched_t;
+
+// Returns the scheduler, for handing to other kernel threads.
+uthread_sched_t* uthread_scheduler();
+
+// This function may be called from any kernel thread. It creates a
+// new user-level thread which runs fn(arg), with priority number
+// specified by argument priority, and hands it to the scheduler. This
+// function returns 0 if succeeds, or -1 otherwise.
+int uthread_submit(uthread_sched_t *sched, void (*fn)(void *), void *arg, int priority);
+
+// Keeps the scheduler running while it has nothing to do, so that the
+// calling kernel thread can go on submitting threads to it.
+void uthread_sched_ref(uthread_sched_t *sched);
+
+// Drops a reference taken by uthread_sched_ref. The scheduler ends the
+// process as usual once it has no threads and no references.
+void uthread_sched_unref(uthread_sched_t *sched);
+
+
+/////////////////////////////////////////////////////////////////////
+//                         Blocking calls                          //
+/////////////////////////////////////////////////////////////////////
+
+
+// Runs fn(arg) on a helper kernel thread, parking the calling
+// user-level thread until it returns. This is for calls which block
+// and can't be made not to, such as getaddrinfo or stat on a slow file
+// system. Other user-level threads run in the meantime, and the caller
+// is then queued again at its priority. Called from a kernel thread
+// which isn't running a user-level thread, it just calls fn(arg). This
+// function returns 0 if succeeds, or -1 otherwise.
+int uthread_run_blocking(void (*fn)(void *), void *arg);
+
+// Sets the most helper kernel threads uthread_run_blocking may use, 4
+// by default. Calls beyond that many at once wait for a helper.
+void uthread_set_blocking_threads(int max_helpers);
+
+
+/////////////////////////////////////////////////////////////////////
+//                         Synchronization                         //
+/////////////////////////////////////////////////////////////////////
+
+
+// The primitives below park waiting user-level threads in the order
+// they wait and release them together onto the run queues, rather
+// than having them poll with uthread_yield. Waiting may only be done
+// from user-level threads; releasing may be done from any kernel
+// thread. The fields of these types are private to the library.
+typedef struct uthread uthread_t;
+
+typedef struct uthread_waitq
+{
+    int lock;               // Protects the queue and the primitive around it
+    uthread_t *head;        // Thread waiting the longest
+    uthread_t *tail;        // Thread waiting the shortest
+} uthread_waitq_t;
+
+// A counting semaphore.
+typedef struct uthread_sem
+{
+    uthread_waitq_t waiters;
+    int count;              // Free permits
+} uthread_sem_t;
+
+// Initializes the semaphore with count permits. This function returns
+// 0 if succeeds, or -1 otherwise.
+int uthread_sem_init(uthread_sem_t *sem, int count);
+
+// Takes a permit from the semaphore, parking the calling thread until
+// one is posted if there are none. This function returns 0 if
+// succeeds, or -1 otherwise.
+int uthread_sem_wait(uthread_sem_t *sem);
+
+// Takes a permit from the semaphore if one is free. This function
+// returns 0 if succeeds, or -1 if there were none.
+int uthread_sem_trywait(uthread_sem_t *sem);
+
+// Adds a permit to the semaphore, waking the longest waiting thread if
+// there is one. This function returns 0 if succeeds, or -1 otherwise.
+int uthread_sem_post(uthread_sem_t *sem);
+
+// Adds n permits to the semaphore, waking up to n waiting threads in
+// the order they waited. This function returns 0 if succeeds, or -1
+// otherwise.
+int uthread_sem_post_n(uthread_sem_t *sem, int n);
+
+// A reusable barrier for a fixed number of threads.
+typedef struct uthread_barrier
+{
+    uthread_waitq_t waiters;
+    int count;              // Threads per round
+    int arrived;            // Threads arrived this round
+} uthread_barrier_t;
+
+// Initializes a barrier for count threads. This function returns 0 if
+// succeeds, or -1 otherwise.
+int uthread_barrier_init(uthread_barrier_t *barrier, int count);
+
+// Parks the calling thread until count threads have called this, then
+// releases them all at once. The barrier can then be used again. This
+// function returns 1 in the last thread to arrive, 0 in the others, or
+// -1 if it fails.
+int uthread_barrier_wait(uthread_barrier_t *barrier);
+
+// A countdown latch, which opens once and stays open.
+typedef struct uthread_latch
+{
+    uthread_waitq_t waiters;
+    int count;              // Count downs left until it opens
+} uthread_latch_t;
+
+// Initializes a latch which opens after count calls to
+// uthread_latch_count_down. This function returns 0 if succeeds, or -1
+// otherwise.
+int uthread_latch_init(uthread_latch_t *latch, int count);
+
+// Counts the latch down by one, opening it and releasing every waiting
+// thread when it reaches zero. Counting down an open latch does
+// nothing.
+void uthread_latch_count_down(uthread_latch_t *latch);
+
+// Parks the calling thread until the latch is open. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_latch_wait(uthread_latch_t *latch);
+
+// A wait group, counting outstanding pieces of work such as threads
+// fanned out by the waiter.
+typedef struct uthread_wg
+{
+    uthread_waitq_t waiters;
+    int count;              // Pieces of work outstanding
+} uthread_wg_t;
+
+// Initializes a wait group with nothing to wait for.
+void uthread_wg_init(uthread_wg_t *wg);
+
+// Adds delta, which may be negative, to the number of pieces of work
+// the group waits for. Waiting threads are released when it reaches
+// zero. This function returns 0 if succeeds, or -1 if the count would
+// go below zero.
+int uthread_wg_add(uthread_wg_t *wg, int delta);
+
+// Marks one piece of work of the group as done. This function returns
+// 0 if succeeds, or -1 if there was none outstanding.
+int uthread_wg_done(uthread_wg_t *wg);
+
+// Parks the calling thread until the group has no work outstanding.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_wg_wait(uthread_wg_t *wg);
+
+// A reader-writer lock for data read far more often than written.
+// Readers count themselves per worker rather than in one shared word.
+typedef struct uthread_rwlock
+{
+    uthread_waitq_t readers;    // Its lock guards the writer queues too
+    uthread_waitq_t writers;    // Writers waiting for another writer
+    uthread_waitq_t drain;      // Writer waiting for readers to leave
+    int writer;                 // Whether a writer holds or is waiting for the lock
+    struct uthread_read_count *counts;  // Readers in per worker
+} uthread_rwlock_t;
+
+// Initializes an unlocked reader-writer lock. This function returns 0
+// if succeeds, or -1 otherwise.
+int uthread_rwlock_init(uthread_rwlock_t *rwlock);
+
+// Frees the memory held by an unlocked reader-writer lock.
+void uthread_rwlock_destroy(uthread_rwlock_t *rwlock);
+
+// Takes the lock for reading, parking the calling thread while a
+// writer holds it or is waiting for it. When no writer is about this
+// is a single atomic add to a counter of the caller's worker. This
+// function returns 0 if succeeds, or -1 otherwise.
+int uthread_rwlock_rdlock(uthread_rwlock_t *rwlock);
+
+// Releases the lock taken for reading.
+void uthread_rwlock_rdunlock(uthread_rwlock_t *rwlock);
+
+// Takes the lock for writing, parking the calling thread until no
+// other writer or reader holds it. Readers arriving meanwhile wait
+// behind it. This function returns 0 if succeeds, or -1 otherwise.
+int uthread_rwlock_wrlock(uthread_rwlock_t *rwlock);
+
+// Releases the lock taken for writing, letting in every parked reader
+// at once.
+void uthread_rwlock_wrunlock(uthread_rwlock_t *rwlock);
+
+// A mutex with priority inheritance. While threads wait for it, its
+// holder runs at the priority of the most urgent of them if that is
+// more urgent than its own, so a low priority holder can't keep a high
+// priority waiter from running. Boosts don't pass along chains of
+// holders waiting for other mutexes.
+typedef struct uthread_mutex
+{
+    uthread_waitq_t waiters;    // Most urgent first, guarded by a library-wide lock
+    uintptr_t owner;            // Holding thread, with the low bit set while others wait
+    struct uthread_mutex *held_next;    // Next contended mutex of the same holder
+    int spin_ns;                // Average time spins for the mutex took to succeed
+} uthread_mutex_t;
+
+// Initializes an unlocked priority inheritance mutex.
+void uthread_mutex_init(uthread_mutex_t *mutex);
+
+// Takes the mutex, parking the calling thread until it is free. While
+// the holder is running on another kernel thread, the caller first
+// spins for as long as waits for this mutex usually take. This
+// function returns 0 if succeeds, or -1 otherwise.
+int uthread_mutex_lock(uthread_mutex_t *mutex);
+
+// Takes the mutex if it is free. This function returns 0 if succeeds,
+// or -1 otherwise.
+int uthread_mutex_trylock(uthread_mutex_t *mutex);
+
+// Releases the mutex held by the calling thread, handing it to the
+// most urgent waiter, and drops the caller back to the priority it
+// asked for. This function returns 0 if succeeds, or -1 if the caller
+// did not hold it.
+int uthread_mutex_unlock(uthread_mutex_t *mutex);
+
+// The parking lot lets any word be waited on, like a futex, so that
+// locks and flags built on it take a byte of the structure holding
+// them and no queue. Threads parked on an address are unparked in the
+// order they parked.
+
+// Parks the calling thread on addr, unless validate(arg) returns 0.
+// validate is called with the parking lot locked for addr, so it can
+// check that the word at addr still says to wait without an unpark
+// slipping in. This function returns 0 once the thread has been
+// unparked, or -1 if it didn't park.
+int uthread_park(const void *addr, int (*validate)(void *), void *arg);
+
+// Unparks the thread which has waited longest on addr, if there is
+// one. If callback isn't NULL, it is called with the parking lot still
+// locked for addr and whether more threads are parked on it, so that
+// the word at addr can be updated first. Returns the number of threads
+// unparked.
+int uthread_unpark_one(const void *addr, void (*callback)(void *, int), void *arg);
+
+// Unparks every thread parked on addr at once. Returns the number of
+// threads unparked.
+int uthread_unpark_all(const void *addr);
+
+// A lock taking one byte, built on the parking lot.
+typedef unsigned char uthread_bytelock_t;
+#define UTHREAD_BYTELOCK_INIT 0
+
+// Takes the byte lock, parking the calling thread until it is free.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_bytelock_acquire(uthread_bytelock_t *lock);
+
+// Releases the byte lock, unparking one thread waiting for it.
+void uthread_bytelock_release(uthread_bytelock_t *lock);
+
+// A flag taking one byte which makes a function run only once.
+typedef unsigned char uthread_once_t;
+#define UTHREAD_ONCE_INIT 0
+
+// Calls fn() if no thread has called it through the flag yet, and
+// otherwise parks the calling thread until that call has returned.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_once(uthread_once_t *once, void (*fn)());
+
+
+/////////////////////////////////////////////////////////////////////
+//                      Thread-local storage                       //
+/////////////////////////////////////////////////////////////////////
+
+
+// Values private to each user-level thread, such as a request's trace
+// ID. Unlike pthread keys these follow the user-level thread from one
+// kernel thread to another. Every thread has room for
+// UTHREAD_KEYS_MAX keys.
+#define UTHREAD_KEYS_MAX 16
+typedef unsigned uthread_key_t;
+
+// Creates a thread-local key, whose value starts as NULL in every
+// thread. When a thread exits with a value other than NULL for the
+// key, destructor is called with it, unless destructor is NULL. This
+// function returns 0 if succeeds, or -1 if there are no keys left.
+int uthread_key_create(uthread_key_t *key, void (*destructor)(void *));
+
+// Deletes a thread-local key. Values threads still hold for it are
+// neither freed nor cleared. This function returns 0 if succeeds, or
+// -1 otherwise.
+int uthread_key_delete(uthread_key_t key);
+
+// Returns the calling thread's value for the key, or NULL if it has
+// none or is not a user-level thread.
+void* uthread_getspecific(uthread_key_t key);
+
+// Sets the calling thread's value for the key. This function returns 0
+// if succeeds, or -1 otherwise.
+int uthread_setspecific(uthread_key_t key, const void *value);
+
+
+/////////////////////////////////////////////////////////////////////
+//                           Cancellation                          //
+/////////////////////////////////////////////////////////////////////
+
+
+// A cancelled thread stops at its next cancellation point: a call to
+// uthread_yield or uthread_testcancel, the return from
+// uthread_run_blocking, a wait on a semaphore, latch, wait group or
+// the parking lot, or before it first runs. It runs its cleanup
+// handlers, newest first, and then exits as if it had called
+// uthread_exit. Waits on barriers, rwlocks and mutexes are not
+// cancellation points.
+
+// This function creates a new user-level thread which runs fn(arg)
+// like uthread_spawn_task, and returns a handle to it, or NULL if it
+// fails. The handle stays valid after the thread exits, until it is
+// given to uthread_release.
+uthread_t* uthread_spawn(void (*fn)(void *), void *arg, int priority);
+
+// Drops a handle returned by uthread_spawn.
+void uthread_release(uthread_t *thread);
+
+// Asks the thread to stop at its next cancellation point, waking it if
+// it is in a cancellable wait. Cancelling a thread which has exited
+// does nothing. This may be called from any kernel thread.
+void uthread_cancel(uthread_t *thread);
+
+// Stops the calling thread here if it has been cancelled.
+void uthread_testcancel();
+
+// A cleanup handler registration, kept by the caller.
+typedef struct uthread_cleanup
+{
+    void (*fn)(void *);         // Function to run on cancellation
+    void *arg;                  // Argument passed to fn
+    struct uthread_cleanup *prev;   // Handler registered before this one
+} uthread_cleanup_t;
+
+// Registers fn(arg) to be run if the calling thread is cancelled
+// before the matching uthread_cleanup_pop. cleanup is storage for the
+// registration, usually on the caller's stack.
+void uthread_cleanup_push(uthread_cleanup_t *cleanup, void (*fn)(void *), void *arg);
+
+// Removes the newest cleanup handler of the calling thread, running it
+// first if execute is not 0.
+void uthread_cleanup_pop(int execute);
+
+
+/////////////////////////////////////////////////////////////////////
+//                           Task groups                           //
+/////////////////////////////////////////////////////////////////////
+
+
+// A group runs related tasks, such as the sub-requests of a scatter-
+// gather request, and is waited for as a whole. The first member to
+// fail cancels the rest. Members' nodes come from slabs owned by the
+// group. The fields are private to the library.
+typedef struct uthread_group
+{
+    uthread_waitq_t waiters;    // Its lock guards the rest of the group
+    int pending;                // Members not yet finished
+    int error;                  // First failing member's result, or 0
+    int cancelled;              // Whether the group has been cancelled
+    uthread_t *running;         // Members not yet finished
+    uthread_t *free_nodes;      // Unused nodes in the slabs
+    struct uthread_group_slab *slabs;   // Slabs of member nodes
+} uthread_group_t;
+
+// Initializes an empty group.
+void uthread_group_init(uthread_group_t *group);
+
+// Creates a member of the group, a task which runs fn(arg) with the
+// given priority. If it returns anything but 0, the first such result
+// is kept for uthread_group_wait and the rest of the group is
+// cancelled. This function returns 0 if succeeds, or -1 otherwise.
+int uthread_group_spawn(uthread_group_t *group, int (*fn)(void *), void *arg, int priority);
+
+// Parks the calling thread until every member of the group has
+// finished, at the cost of a single park however many there are. If
+// the caller has been cancelled, the members are cancelled and waited
+// for before it unwinds. Returns the first result other than 0 a
+// member returned, 0 if there was none, or -1 if the caller is not a
+// user-level thread.
+int uthread_group_wait(uthread_group_t *group);
+
+// Cancels every member of the group which is still running, and any
+// spawned into it later.
+void uthread_group_cancel(uthread_group_t *group);
+
+// Frees the group's slabs. The group must have no members left, as
+// after uthread_group_wait.
+void uthread_group_destroy(uthread_group_t *group);
+
+
+/////////////////////////////////////////////////////////////////////
+//                      Futures and promises                       //
+/////////////////////////////////////////////////////////////////////
+
+
+// A promise is set once with a value, which the future it holds then
+// gives to every thread asking for it. The fields are private to the
+// library.
+typedef struct uthread_future
+{
+    uthread_waitq_t waiters;    // Its lock guards the rest of the future
+    int ready;                  // Whether the value has been set
+    void *value;                // The value, once set
+    struct uthread_watch *watches;  // Continuations and combinators waiting
+} uthread_future_t;
+
+typedef struct uthread_promise
+{
+    uthread_future_t future;    // The future the promise sets
+} uthread_promise_t;
+
+// Initializes a promise which is not yet set.
+void uthread_promise_init(uthread_promise_t *promise);
+
+// Returns the future whose value the promise sets.
+uthread_future_t* uthread_promise_future(uthread_promise_t *promise);
+
+// Sets the promise's value, waking every thread waiting for it in one
+// batch and starting its continuations. A continuation whose task
+// can't be created runs in the caller before this returns. This may be
+// called from any kernel thread. This function returns 0 if succeeds,
+// or -1 if the promise was already set.
+int uthread_promise_set(uthread_promise_t *promise, void *value);
+
+// Returns whether the future's value has been set.
+int uthread_future_ready(uthread_future_t *future);
+
+// Stores the future's value in *value, parking the calling thread
+// until it is set. A future which is already set is read without
+// taking any lock. This is a cancellation point. This function returns
+// 0 if succeeds, or -1 otherwise.
+int uthread_future_get(uthread_future_t *future, void **value);
+
+// Arranges for fn(value, arg) to run as a task with the given priority
+// once the future's value is set, or straight away if it already is.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_future_then(uthread_future_t *future, void (*fn)(void *, void *), void *arg,
+                        int priority);
+
+// Parks the calling thread, once, until every one of the count futures
+// is set. This function returns 0 if succeeds, or -1 otherwise.
+int uthread_when_all(uthread_future_t **futures, int count);
+
+// Parks the calling thread, once, until any of the count futures is
+// set. Returns the index of a future which is set, or -1 if it fails.
+int uthread_when_any(uthread_future_t **futures, int count);
+
+
+/////////////////////////////////////////////////////////////////////
+//                      Multiple kernel threads                    //
+/////////////////////////////////////////////////////////////////////
+
+
+// Runs user-level threads on count kernel threads in total, counting
+// the one which called system_init. Each has its own run queues, and
+// one which runs out of threads steals half of another's, trying the
+// nearest kernel threads first. If the process may run on at least
+// count CPUs, each kernel thread is pinned to one, and its stacks come
+// from its NUMA node. Threads created with UTHREAD_SHARED_STACK stay
+// on the kernel thread they first ran on. This needs a build with
+// UTHREAD_LOCKING set to the spinlock or semaphore. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_start_workers(int count);
+
+// Where a kernel thread sits in the machine.
+typedef struct uthread_place
+{
+    int cpu;        // CPU to pin the kernel thread to, or -1 for none
+    int core;       // Physical core, or -1 if unknown
+    int package;    // Socket
+    int node;       // NUMA node, or -1 if unknown
+} uthread_place_t;
+
+// Describes the machine to the scheduler in place of what it reads from
+// /sys, such as to try out a topology the machine doesn't have. The
+// kernel thread in slot i, counting the one which called system_init
+// as slot 0, is put at places[i], and steals from the others nearest
+// first by core, node and socket. If more kernel threads are started
+// than there are places, none are placed. This must be called before
+// uthread_start_workers, and needs the same build. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_set_topology(const uthread_place_t *places, int count);
+
+// Sets how idle kernel threads wait for work. At most max_spinners of
+// them, or half of them if max_spinners is negative, poll for new work
+// for spin_us microseconds before parking; the rest park straight away.
+// The default is half of them for 50 microseconds.
+void uthread_set_spinning(int max_spinners, unsigned spin_us);
+
+// Lets the scheduler start more kernel threads, up to max_workers in
+// total, while threads are kept waiting, and retire those it started
+// once they have been idle for linger_ms milliseconds. A supervisor
+// kernel thread checks the run queues every millisecond and adds a
+// kernel thread when threads have been waiting with none idle for a few
+// checks in a row. Kernel threads started by uthread_start_workers are
+// never retired. Like that function, this needs a build with
+// UTHREAD_LOCKING set to the spinlock or semaphore. This function
+// returns 0 if succeeds, or -1 otherwise.
+int uthread_set_elastic(int max_workers, unsigned linger_ms);
+
+// Watches for kernel threads stuck running one user-level thread for
+// longer than stall_ms milliseconds while others wait for them, such as
+// one blocked in a system call the library doesn't know about. Another
+// kernel thread is started in place of each, to take over the waiting
+// threads, and retires once idle like those uthread_set_elastic starts.
+// Threads created with UTHREAD_SHARED_STACK still wait for the stuck
+// kernel thread. This needs the same build as uthread_start_workers.
+// This function returns 0 if succeeds, or -1 otherwise.
+int uthread_set_stall_limit(unsigned stall_ms);
+
+// Scheduler counters, summed over all kernel threads.
+typedef struct uthread_stats
+{
+    int workers;                        // Kernel threads running user-level threads
+    int peak_workers;                   // Most kernel threads ever running at once
+    unsigned long long workers_started; // Kernel threads started, counting the first
+    unsigned long long workers_retired; // Kernel threads retired for being idle
+    unsigned long long stalls;          // Kernel threads found stuck and replaced
+    int nodes;                          // NUMA nodes they are pinned across
+    unsigned long long steals;          // Threads stolen from another kernel thread
+    unsigned long long remote_steals;   // Threads stolen from another NUMA node
+} uthread_stats_t;
+
+// Fills in stats with the scheduler's counters so far.
+void uthread_get_stats(uthread_stats_t *stats);
+
+
+/////////////////////////////////////////////////////////////////////
+//                     Off-CPU wait tracking                       //
+/////////////////////////////////////////////////////////////////////
+
+
+// The reasons a user-level thread can be off the kernel thread. Every
+// place that parks a thread tags it with one of these, and the time
+// until it is woken is charged to that reason.
+enum uthread_wait_reason
+{
+    UTHREAD_WAIT_PREEMPTED,     // Ready to run, waiting for the kernel thread
+    UTHREAD_WAIT_MUTEX,         // Blocked acquiring a lock
+    UTHREAD_WAIT_IO,            // Blocked in a call run with uthread_run_blocking
+    UTHREAD_WAIT_SYNC,          // Parked on a synchronization primitive or address
+    UTHREAD_WAIT_REASONS        // Number of wait reasons
+};
+
+// Names the calling user-level thread. Off-CPU time is aggregated
+// per name, so threads doing the same job should share a name.
+void uthread_set_name(const char *name);
+
+// Returns the total off-CPU time in nanoseconds charged to the given
+// wait reason by threads with the given name, or by all threads if
+// name is NULL.
+unsigned long long uthread_offcpu_time(int reason, const char *name);
+
+// Writes the aggregate off-CPU time per wait reason and per thread
+// name to out.
+void uthread_offcpu_report(FILE *out);
+
+
+/////////////////////////////////////////////////////////////////////
+//                    Stack use measurement                        //
+/////////////////////////////////////////////////////////////////////
+
+
+// Turns stack painting on or off. While it is on, every new stack is
+// filled with a pattern so that each thread's stack high-water mark
+// can be measured when it exits, and later threads running the same
+// function get a larger stack size class if they needed more than the
+// default. Every stack ends in a canary word, and a thread found to
+// have run past it, say on a deeper run than those measured, aborts
+// the process.
+void uthread_set_stack_painting(int enable);
+
+// Turns stack shrinking on or off. While it is on, threads running a
+// function measured with stack painting may get a stack smaller than
+// the default, though never smaller than 8 KB and always with 4 KB to
+// spare beyond half again the deepest measured run.
+void uthread_set_stack_shrinking(int enable);
+
+// Returns the deepest stack use in bytes measured for threads running
+// func(), or 0 if none have run on a painted stack.
+size_t uthread_stack_high_water(void func());
+
+// Writes the measured stack high-water mark and the stack size picked
+// for every function that has run on a painted stack to out.
+void uthread_stack_report(FILE *out);
@@ -0,0 +1,78 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "uthread.h"
+
+// Microbenchmarks of the scheduler's fast paths, run on the kernel
+// thread which calls system_init. Build and run with
+//
+//     cc -O2 -pthread uthread.c uthread_bench.c && ./a.out
+//
+// and with -DUTHREAD_LOCKING=1 or -DUTHREAD_LOCKING=2 to compare the
+// cost of the spinlock and semaphore queue locks against none.
+
+
+// Returns the monotonic clock in nanoseconds.
+unsigned long long now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Counts the threads of a benchmark which haven't finished.
+uthread_wg_t running;
+
+
+/////////////////////////////////////////////////////////////////////
+//                          Yield ping-pong                        //
+/////////////////////////////////////////////////////////////////////
+
+
+#define YIELDS 2000000
+
+void ping_pong()
+{
+    for (int i = 0; i < YIELDS; i++)
+    {
+        uthread_yield(1);
+    }
+    uthread_wg_done(&running);
+}
+
+// Two threads yielding to each other, so every yield is one trip
+// through the run queue and one context switch.
+void bench_yield()
+{
+    uthread_wg_add(&running, 2);
+    unsigned long long start = now();
+    uthread_create(ping_pong, 1);
+    uthread_create(ping_pong, 1);
+    uthread_wg_wait(&running);
+    printf("yield ping-pong     %6.1f ns/yield\n", (double) (now() - start) / (2.0 * YIELDS));
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                              Driver                             //
+/////////////////////////////////////////////////////////////////////
+
+
+void run_benchmarks()
+{
+    bench_yield();
+}
+
+int main()
+{
+    system_init();
+    uthread_wg_init(&running);
+    uthread_create(run_benchmarks, 0);
+    uthread_exit();
+}
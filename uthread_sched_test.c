@@ -0,0 +1,1120 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "uthread.h"
+
+// Tests of the scheduler itself. Build and run with
+//
+//     cc -O2 -pthread uthread.c uthread_sched_test.c && ./a.out
+//
+// and again with -DUTHREAD_LOCKING=1, which runs the same tests on
+// four kernel threads. The process exits with 1 at the first failed
+// check.
+
+
+// Stops the run if cond is false.
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+void check(int ok, const char *what, int line)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "uthread_sched_test.c:%d: check failed: %s\n", line, what);
+        exit(1);
+    }
+}
+
+// Kernel threads running user-level threads.
+int workers = 1;
+
+// Counts threads of the test running, so that it can wait for them.
+uthread_wg_t running;
+
+// Returns the given clock's time in nanoseconds.
+unsigned long long clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Exit status of a forked run which couldn't start its kernel threads.
+#define SKIPPED 3
+
+// The kernel thread of a forked run's first worker.
+pthread_t first_worker;
+
+// Runs body() as the first user-level thread of a child process on the
+// given number of kernel threads, placed as given unless topology is
+// NULL. The child is forked off before this process's scheduler
+// starts, and body() ends it with exit(0). Returns the child's exit
+// status.
+int run_forked(void body(), int count, const uthread_place_t *topology)
+{
+    fflush(stdout);
+    pid_t child = fork();
+    CHECK(child >= 0);
+    if (child == 0)
+    {
+        first_worker = pthread_self();
+        system_init();
+        if (topology && uthread_set_topology(topology, count) != 0)
+        {
+            exit(SKIPPED);
+        }
+        if (count > 1 && uthread_start_workers(count) != 0)
+        {
+            exit(SKIPPED);
+        }
+        uthread_wg_init(&running);
+        uthread_create(body, 1);
+        uthread_exit();
+    }
+
+    int status;
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFEXITED(status));
+    return WEXITSTATUS(status);
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                        Stack measurement                        //
+/////////////////////////////////////////////////////////////////////
+
+
+// Writes every byte of the stack from top down to bytes below it.
+__attribute__((noinline)) int descend(char *top, size_t bytes)
+{
+    volatile char pad[64];
+    for (size_t i = 0; i < sizeof(pad); i++)
+    {
+        pad[i] = (char) i;
+    }
+    if ((size_t) (top - (char *) pad) < bytes)
+    {
+        return descend(top, bytes) + pad[0];
+    }
+    return pad[0];
+}
+
+// How far the next run of measured() goes down its stack.
+size_t depth;
+
+void measured()
+{
+    descend((char *) __builtin_frame_address(0), depth);
+    uthread_wg_done(&running);
+}
+
+// Starts a run of measured() that goes further than the smallest stack
+// class, once the first run has been measured.
+void overflow()
+{
+    depth = 8192 + 128;
+    uthread_create(measured, 1);
+}
+
+// Runs measured() once shallowly with stack shrinking on so that it
+// gets the smallest stack, then once deeper than that. The second run has to abort the process
+// rather than run on over the block's context.
+void test_stack_canary()
+{
+    pid_t child = fork();
+    CHECK(child >= 0);
+    if (child == 0)
+    {
+        if (!freopen("/dev/null", "w", stderr))
+        {
+            exit(2);
+        }
+        system_init();
+        uthread_wg_init(&running);
+        uthread_wg_add(&running, 2);
+        uthread_set_stack_painting(1);
+        uthread_set_stack_shrinking(1);
+        depth = 256;
+        uthread_create(measured, 1);
+        uthread_create(overflow, 2);
+        uthread_exit();
+    }
+
+    int status;
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+    printf("ok stack canary\n");
+}
+
+// Measures a thread's stack use on a painted stack.
+void test_stack_painting()
+{
+    uthread_set_stack_painting(1);
+    depth = 2048;
+    uthread_wg_add(&running, 1);
+    uthread_create(measured, 1);
+    uthread_wg_wait(&running);
+    uthread_set_stack_painting(0);
+
+    size_t high_water = uthread_stack_high_water(measured);
+    CHECK(high_water >= 2048 && high_water < 4096);
+    printf("ok stack painting\n");
+}
+
+// Runs measured() deeper than the smallest stack class fits once it has
+// been measured shallowly. With stack shrinking off it keeps the
+// default class, so the run must not reach the canary.
+void test_stack_default_class()
+{
+    uthread_set_stack_painting(1);
+    depth = 8192 + 128;
+    uthread_wg_add(&running, 1);
+    uthread_create(measured, 1);
+    uthread_wg_wait(&running);
+    uthread_set_stack_painting(0);
+
+    CHECK(uthread_stack_high_water(measured) >= 8192);
+
+    // The report shows the class the next run would get
+    char line[128];
+    int reported = 0;
+    FILE *report = tmpfile();
+    CHECK(report != NULL);
+    uthread_stack_report(report);
+    rewind(report);
+    while (fgets(line, sizeof(line), report))
+    {
+        void *func;
+        size_t size;
+        if (sscanf(line, "%p %*u %*u %zu", &func, &size) == 2 && func == (void *) measured)
+        {
+            reported = size == 32768;
+        }
+    }
+    fclose(report);
+    CHECK(reported);
+    printf("ok stack default class\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                          Shared stacks                          //
+/////////////////////////////////////////////////////////////////////
+
+
+#define SHARED_THREADS 200
+
+int next_id;
+
+// Fills a frame with the thread's id at each of depth levels, switches
+// away at the bottom, and checks every frame on the way back up.
+void fill_frames(int depth, int id)
+{
+    char frame[1000];
+    memset(frame, id, sizeof(frame));
+    if (depth > 0)
+    {
+        fill_frames(depth - 1, id);
+    }
+    else
+    {
+        for (int i = 0; i < 5; i++)
+        {
+            uthread_yield(1);
+        }
+    }
+    for (size_t i = 0; i < sizeof(frame); i++)
+    {
+        CHECK(frame[i] == (char) id);
+    }
+}
+
+void shared_thread()
+{
+    int id = __atomic_add_fetch(&next_id, 1, __ATOMIC_SEQ_CST);
+    fill_frames(id % 7, id);
+    uthread_wg_done(&running);
+}
+
+void own_stack_thread()
+{
+    for (int i = 0; i < 20; i++)
+    {
+        uthread_yield(1);
+    }
+    uthread_wg_done(&running);
+}
+
+// Threads on a worker's shared stack, of different depths, switch
+// among each other and threads with stacks of their own, and find
+// their frames as they left them.
+void test_shared_stack()
+{
+    next_id = 0;
+    uthread_wg_add(&running, SHARED_THREADS + 2);
+    for (int i = 0; i < SHARED_THREADS; i++)
+    {
+        CHECK(uthread_create_flags(shared_thread, 1, UTHREAD_SHARED_STACK) == 0);
+    }
+    CHECK(uthread_create(own_stack_thread, 1) == 0);
+    CHECK(uthread_create(own_stack_thread, 1) == 0);
+    uthread_wg_wait(&running);
+    printf("ok shared stack\n");
+}
+
+/////////////////////////////////////////////////////////////////////
+//                        Many kernel threads                      //
+/////////////////////////////////////////////////////////////////////
+
+
+#define MANY_TASKS 20000
+#define MANY_SHARED 100
+
+int runs[MANY_TASKS];
+int shared_runs;
+
+// Runs five times, switching away at its own priority in between.
+void counted_task(void *arg)
+{
+    long i = (long) arg;
+    for (int k = 0; k < 5; k++)
+    {
+        __atomic_add_fetch(&runs[i], 1, __ATOMIC_RELAXED);
+        uthread_yield(i % 40);
+    }
+    uthread_wg_done(&running);
+}
+
+void counted_shared()
+{
+    for (int k = 0; k < 10; k++)
+    {
+        __atomic_add_fetch(&shared_runs, 1, __ATOMIC_RELAXED);
+        uthread_yield(3);
+    }
+    uthread_wg_done(&running);
+}
+
+// Every task spawned or submitted runs exactly as often as it asks to,
+// at every priority level, however the kernel threads share them out.
+void test_many_workers()
+{
+    uthread_stats_t stats;
+    uthread_get_stats(&stats);
+    CHECK(stats.workers == workers);
+    CHECK(stats.workers_started >= (unsigned long long) workers);
+
+    memset(runs, 0, sizeof(runs));
+    shared_runs = 0;
+    uthread_wg_add(&running, MANY_TASKS + MANY_SHARED);
+    for (long i = 0; i < MANY_TASKS; i++)
+    {
+        if (i % 2)
+        {
+            CHECK(uthread_spawn_task(counted_task, (void *) i, i % 40) == 0);
+        }
+        else
+        {
+            CHECK(uthread_submit(uthread_scheduler(), counted_task, (void *) i, i % 40) == 0);
+        }
+    }
+    for (int i = 0; i < MANY_SHARED; i++)
+    {
+        CHECK(uthread_create_flags(counted_shared, 3, UTHREAD_SHARED_STACK) == 0);
+    }
+    uthread_wg_wait(&running);
+
+    for (int i = 0; i < MANY_TASKS; i++)
+    {
+        CHECK(runs[i] == 5);
+    }
+    CHECK(shared_runs == 10 * MANY_SHARED);
+    uthread_get_stats(&stats);
+    CHECK(stats.remote_steals <= stats.steals);
+    printf("ok many workers\n");
+}
+
+/////////////////////////////////////////////////////////////////////
+//                           Work stealing                         //
+/////////////////////////////////////////////////////////////////////
+
+
+#define LOW_TASKS 64
+
+int holding;
+int released;
+int low_ran;
+int urgent_after;
+
+// Holds its kernel thread until released.
+void holder()
+{
+    __atomic_store_n(&holding, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&released, __ATOMIC_ACQUIRE))
+    {
+    }
+}
+
+void low_task(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&low_ran, 1, __ATOMIC_SEQ_CST);
+}
+
+// Notes how many low priority tasks ran before it.
+void urgent_task(void *arg)
+{
+    (void) arg;
+    __atomic_store_n(&urgent_after, __atomic_load_n(&low_ran, __ATOMIC_SEQ_CST), __ATOMIC_RELEASE);
+}
+
+// Keeps the other kernel thread busy while queueing low priority tasks
+// and then an urgent one here, then holds on to this kernel thread
+// while the other one steals from it.
+void urgent_first()
+{
+    // The holder is the least urgent, so that what the other kernel
+    // thread has queued of its own doesn't limit what it steals
+    urgent_after = -1;
+    CHECK(uthread_create(holder, 31) == 0);
+    while (!__atomic_load_n(&holding, __ATOMIC_ACQUIRE))
+    {
+    }
+    for (int i = 0; i < LOW_TASKS; i++)
+    {
+        CHECK(uthread_spawn_task(low_task, NULL, 30) == 0);
+    }
+    CHECK(uthread_spawn_task(urgent_task, NULL, 0) == 0);
+    __atomic_store_n(&released, 1, __ATOMIC_RELEASE);
+
+    unsigned long long start = clock_ns(CLOCK_MONOTONIC);
+    while (__atomic_load_n(&urgent_after, __ATOMIC_ACQUIRE) < 0 &&
+           clock_ns(CLOCK_MONOTONIC) - start < 1000000000ULL)
+    {
+    }
+    CHECK(__atomic_load_n(&urgent_after, __ATOMIC_ACQUIRE) == 0);
+    exit(0);
+}
+
+// A kernel thread with nothing of its own steals the most urgent work
+// another has queued, even when less urgent work was queued first.
+void test_urgent_steal()
+{
+    int status = run_forked(urgent_first, 2, NULL);
+    if (status == SKIPPED)
+    {
+        printf("skipped urgent steal, which needs a locking build\n");
+        return;
+    }
+    CHECK(status == 0);
+    printf("ok urgent steal\n");
+}
+
+#define NEAR_TASKS 16
+
+// Two NUMA nodes of two cores each, with no CPUs to pin to. The first
+// worker shares its node with the last, so that trying victims in slot
+// order would get to the other node first.
+const uthread_place_t two_nodes[4] =
+{
+    { -1, 0, 0, 0 }, { -1, 1, 0, 1 }, { -1, 2, 0, 1 }, { -1, 3, 0, 0 }
+};
+
+int arrived;
+int producers_done;
+int near_ran;
+int near_from[3 * NEAR_TASKS];
+unsigned long long near_remote[3 * NEAR_TASKS];
+uthread_stats_t near_before;
+uthread_stats_t near_after;
+
+// Notes which producer queued it, and how many remote steals there had
+// been when it ran.
+void near_task(void *arg)
+{
+    uthread_stats_t stats;
+    uthread_get_stats(&stats);
+    CHECK(pthread_equal(pthread_self(), first_worker));
+    int i = __atomic_fetch_add(&near_ran, 1, __ATOMIC_SEQ_CST);
+    near_from[i] = (int) (long) arg;
+    near_remote[i] = stats.remote_steals;
+    if (i == 3 * NEAR_TASKS - 1)
+    {
+        near_after = stats;
+    }
+}
+
+// Holds a kernel thread of its own. The one on the first worker waits
+// for the others to queue tasks and then leaves its kernel thread to
+// steal them, while the others hold on to theirs until it has.
+void producer()
+{
+    static int next_id;
+    __atomic_add_fetch(&arrived, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&arrived, __ATOMIC_SEQ_CST) < 4)
+    {
+    }
+
+    if (pthread_equal(pthread_self(), first_worker))
+    {
+        while (__atomic_load_n(&producers_done, __ATOMIC_SEQ_CST) < 3)
+        {
+        }
+        uthread_get_stats(&near_before);
+        uthread_wg_done(&running);
+        return;
+    }
+
+    long id = __atomic_fetch_add(&next_id, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < NEAR_TASKS; i++)
+    {
+        CHECK(uthread_spawn_task(near_task, (void *) id, 1) == 0);
+    }
+    __atomic_add_fetch(&producers_done, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&near_ran, __ATOMIC_SEQ_CST) < 3 * NEAR_TASKS)
+    {
+    }
+    uthread_wg_done(&running);
+}
+
+// Puts a producer on each kernel thread, and checks that the first
+// worker took every task from the producer on its own node before any
+// from the other node, and counted only the latter as remote steals.
+void near_first()
+{
+    uthread_stats_t stats;
+    uthread_get_stats(&stats);
+    CHECK(stats.nodes == 2);
+
+    uthread_wg_add(&running, 4);
+    for (int i = 0; i < 4; i++)
+    {
+        CHECK(uthread_create(producer, 1) == 0);
+    }
+    uthread_wg_wait(&running);
+
+    for (int i = 0; i < 3 * NEAR_TASKS; i++)
+    {
+        if (i < NEAR_TASKS)
+        {
+            CHECK(near_from[i] == near_from[0]);
+            CHECK(near_remote[i] == near_before.remote_steals);
+        }
+        else
+        {
+            CHECK(near_from[i] != near_from[0]);
+        }
+    }
+    CHECK(near_after.steals - near_before.steals == 3 * NEAR_TASKS);
+    CHECK(near_after.remote_steals - near_before.remote_steals == 2 * NEAR_TASKS);
+    exit(0);
+}
+
+// A kernel thread steals from others on its own NUMA node before those
+// on another, and only steals from another node count as remote, on a
+// made up machine with two nodes.
+void test_near_steal()
+{
+    int status = run_forked(near_first, 4, two_nodes);
+    if (status == SKIPPED)
+    {
+        printf("skipped near steal, which needs a locking build\n");
+        return;
+    }
+    CHECK(status == 0);
+    printf("ok near steal\n");
+}
+
+/////////////////////////////////////////////////////////////////////
+//              Submitting from other kernel threads               //
+/////////////////////////////////////////////////////////////////////
+
+
+#define SUBMITTERS 4
+#define SUBMITTED 5000
+
+int submitted_runs;
+
+void submitted_task(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&submitted_runs, 1, __ATOMIC_RELAXED);
+    uthread_yield(1);
+    uthread_wg_done(&running);
+}
+
+// A kernel thread the scheduler doesn't know, handing it tasks at
+// every priority while the workers run earlier ones.
+void* submitter(void *arg)
+{
+    uthread_sched_t *sched = (uthread_sched_t *) arg;
+    uthread_sched_ref(sched);
+    for (long i = 0; i < SUBMITTED; i++)
+    {
+        CHECK(uthread_submit(sched, submitted_task, NULL, i % 40) == 0);
+    }
+    uthread_sched_unref(sched);
+
+    // Not being a user-level thread, it has nothing to yield
+    CHECK(uthread_yield(1) == -1);
+    return NULL;
+}
+
+// Tasks submitted by several foreign kernel threads at once all run,
+// once each.
+void test_foreign_submit()
+{
+    pthread_t threads[SUBMITTERS];
+    submitted_runs = 0;
+    uthread_wg_add(&running, SUBMITTERS * SUBMITTED);
+    for (int i = 0; i < SUBMITTERS; i++)
+    {
+        CHECK(pthread_create(&threads[i], NULL, submitter, uthread_scheduler()) == 0);
+    }
+    uthread_wg_wait(&running);
+    for (int i = 0; i < SUBMITTERS; i++)
+    {
+        CHECK(pthread_join(threads[i], NULL) == 0);
+    }
+    CHECK(submitted_runs == SUBMITTERS * SUBMITTED);
+    printf("ok foreign submit\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                           Idle workers                          //
+/////////////////////////////////////////////////////////////////////
+
+
+void nap(void *arg)
+{
+    usleep((useconds_t) (long) arg);
+}
+
+// While the only thread sleeps in a blocking call, every kernel thread
+// spins briefly and then parks, so the process uses a small part of a
+// CPU over the sleep.
+void test_idle_workers()
+{
+    unsigned long long wall = clock_ns(CLOCK_MONOTONIC);
+    unsigned long long cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    CHECK(uthread_run_blocking(nap, (void *) 200000L) == 0);
+    wall = clock_ns(CLOCK_MONOTONIC) - wall;
+    cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    CHECK(wall >= 200000000ULL);
+    CHECK(cpu < wall / 10);
+    printf("ok idle workers\n");
+}
+
+/////////////////////////////////////////////////////////////////////
+//                          Run-next slot                          //
+/////////////////////////////////////////////////////////////////////
+
+
+#define ROUNDS 100
+
+// Threads of the run-next tests note the order they ran in here.
+int run_order[2];
+int run_count;
+
+uthread_sem_t wakeup;
+
+// Waits to be woken and notes that it ran.
+void woken()
+{
+    uthread_sem_wait(&wakeup);
+    run_order[run_count++] = 1;
+    uthread_wg_done(&running);
+}
+
+// Notes that it ran.
+void queued_first()
+{
+    run_order[run_count++] = 2;
+    uthread_wg_done(&running);
+}
+
+// Wakes a thread at the given priority while another of that priority
+// was queued before it. The woken one has to run first.
+void check_wake_order(int priority)
+{
+    run_count = 0;
+    uthread_wg_add(&running, 2);
+    CHECK(uthread_create(woken, priority) == 0);
+    uthread_yield(1);
+    CHECK(uthread_create(queued_first, priority) == 0);
+    uthread_sem_post(&wakeup);
+    uthread_wg_wait(&running);
+    CHECK(run_count == 2 && run_order[0] == 1 && run_order[1] == 2);
+}
+
+uthread_sem_t ping;
+uthread_sem_t pong;
+int handoffs;
+int cut_in;
+
+// Notes how many handoffs went by before it got to run.
+void cutter()
+{
+    cut_in = handoffs;
+    uthread_wg_done(&running);
+}
+
+// Hands control back to pinger() ROUNDS times.
+void ponger()
+{
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        uthread_sem_wait(&pong);
+        handoffs++;
+        uthread_sem_post(&ping);
+    }
+    uthread_wg_done(&running);
+}
+
+// Hands control to ponger() ROUNDS times, queueing cutter() behind
+// them once they are under way.
+void pinger()
+{
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        if (i == 1)
+        {
+            CHECK(uthread_create(cutter, 1) == 0);
+        }
+        uthread_sem_post(&pong);
+        uthread_sem_wait(&ping);
+        handoffs++;
+    }
+    uthread_wg_done(&running);
+}
+
+// Runs the run-next checks whose order is only fixed on one kernel
+// thread, then ends the process.
+void runnext_order()
+{
+    CHECK(uthread_sem_init(&wakeup, 0) == 0);
+    check_wake_order(1);
+    check_wake_order(0);
+
+    // Two threads waking each other don't keep a queued one waiting
+    // for more than a few turns of the cap on run-next dispatches
+    CHECK(uthread_sem_init(&ping, 0) == 0);
+    CHECK(uthread_sem_init(&pong, 0) == 0);
+    handoffs = 0;
+    cut_in = -1;
+    uthread_wg_add(&running, 3);
+    CHECK(uthread_create(ponger, 1) == 0);
+    CHECK(uthread_create(pinger, 1) == 0);
+    uthread_wg_wait(&running);
+    CHECK(cut_in >= 0 && cut_in < 20);
+    exit(0);
+}
+
+// A woken thread at least as urgent as its waker runs before threads
+// queued at its level, but not for ever. Run on a single kernel thread,
+// where the order is fixed.
+void test_runnext_order()
+{
+    CHECK(run_forked(runnext_order, 1, NULL) == 0);
+    printf("ok run-next order\n");
+}
+
+uthread_sem_t parked;
+unsigned long long woken_at;
+
+// Lets its waker know it is about to block, then notes when it was
+// woken.
+void stolen()
+{
+    uthread_sem_post(&parked);
+    uthread_sem_wait(&wakeup);
+    __atomic_store_n(&woken_at, clock_ns(CLOCK_MONOTONIC), __ATOMIC_RELEASE);
+    uthread_wg_done(&running);
+}
+
+// A thread woken into the slot of a worker which then keeps running
+// its waker is taken by another worker, once the grace period is over.
+void test_runnext_steal()
+{
+    if (workers == 1)
+    {
+        printf("skipped run-next steal, which needs a locking build\n");
+        return;
+    }
+
+    uthread_stats_t before;
+    uthread_get_stats(&before);
+    CHECK(uthread_sem_init(&wakeup, 0) == 0);
+    CHECK(uthread_sem_init(&parked, 0) == 0);
+    woken_at = 0;
+    uthread_wg_add(&running, 1);
+
+    // As urgent as the tests' thread, so that waking it fills the slot
+    CHECK(uthread_create(stolen, 0) == 0);
+    uthread_sem_wait(&parked);
+
+    // Gives it time to block, then wakes it and holds on to this
+    // kernel thread until it runs elsewhere
+    unsigned long long start = clock_ns(CLOCK_MONOTONIC);
+    while (clock_ns(CLOCK_MONOTONIC) - start < 1000000ULL)
+    {
+    }
+    unsigned long long posted = clock_ns(CLOCK_MONOTONIC);
+    uthread_sem_post(&wakeup);
+    while (!__atomic_load_n(&woken_at, __ATOMIC_ACQUIRE) &&
+           clock_ns(CLOCK_MONOTONIC) - posted < 1000000000ULL)
+    {
+    }
+    unsigned long long ran = __atomic_load_n(&woken_at, __ATOMIC_ACQUIRE);
+    CHECK(ran != 0);
+    CHECK(ran - posted >= 3000);
+    uthread_wg_wait(&running);
+
+    uthread_stats_t stats;
+    uthread_get_stats(&stats);
+    CHECK(stats.steals > before.steals);
+    printf("ok run-next steal\n");
+}
+
+/////////////////////////////////////////////////////////////////////
+//                         Blocking calls                          //
+/////////////////////////////////////////////////////////////////////
+
+
+#define BLOCKERS 8
+
+int in_flight;
+int most_in_flight;
+int blockers_done;
+int ticks;
+
+// Sleeps like nap, keeping note of how many calls run at once.
+void counted_nap(void *arg)
+{
+    int now = __atomic_add_fetch(&in_flight, 1, __ATOMIC_SEQ_CST);
+    int most = __atomic_load_n(&most_in_flight, __ATOMIC_SEQ_CST);
+    while (now > most && !__atomic_compare_exchange_n(&most_in_flight, &most, now, 0,
+                                                      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    {
+    }
+    nap(arg);
+    __atomic_sub_fetch(&in_flight, 1, __ATOMIC_SEQ_CST);
+}
+
+void blocking_task(void *arg)
+{
+    (void) arg;
+    CHECK(uthread_run_blocking(counted_nap, (void *) 20000L) == 0);
+    __atomic_add_fetch(&blockers_done, 1, __ATOMIC_SEQ_CST);
+    uthread_wg_done(&running);
+}
+
+int inline_calls;
+
+void count_call(void *arg)
+{
+    (void) arg;
+    inline_calls++;
+}
+
+// A kernel thread the scheduler doesn't know, making a blocking call.
+void* foreign_caller(void *arg)
+{
+    (void) arg;
+    CHECK(uthread_run_blocking(count_call, NULL) == 0);
+    return NULL;
+}
+
+// Counts its turns until the blocked threads are back.
+void ticker()
+{
+    while (__atomic_load_n(&blockers_done, __ATOMIC_SEQ_CST) < BLOCKERS)
+    {
+        __atomic_add_fetch(&ticks, 1, __ATOMIC_RELAXED);
+        uthread_yield(1);
+    }
+    uthread_wg_done(&running);
+    uthread_exit();
+}
+
+// Blocking calls from tasks run on no more helpers than allowed, the
+// rest waiting their turn, while other threads go on running.
+void test_blocking_calls()
+{
+    uthread_set_blocking_threads(2);
+    uthread_wg_add(&running, BLOCKERS + 1);
+    CHECK(uthread_create(ticker, 1) == 0);
+    for (int i = 0; i < BLOCKERS; i++)
+    {
+        CHECK(uthread_spawn_task(blocking_task, NULL, 1) == 0);
+    }
+    uthread_wg_wait(&running);
+    CHECK(blockers_done == BLOCKERS);
+    CHECK(most_in_flight == 2);
+    CHECK(ticks > 0);
+    uthread_set_blocking_threads(4);
+
+    // Outside a user-level thread the call is just made there and then
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, foreign_caller, NULL) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+    CHECK(inline_calls == 1);
+    printf("ok blocking calls\n");
+}
+
+/////////////////////////////////////////////////////////////////////
+//                          Off-CPU time                           //
+/////////////////////////////////////////////////////////////////////
+
+
+#define SLEEPERS 4
+#define SLEEP_US 20000
+
+uthread_sem_t handed;
+
+// Spends one semaphore wait and one blocking call off the CPU.
+void sleeper(void *arg)
+{
+    (void) arg;
+    uthread_set_name("test-sleeper");
+    CHECK(uthread_sem_wait(&handed) == 0);
+    CHECK(uthread_run_blocking(nap, (void *) (long) SLEEP_US) == 0);
+    uthread_wg_done(&running);
+}
+
+uthread_rwlock_t held;
+
+// Spends one wait for a lock off the CPU.
+void reader(void *arg)
+{
+    (void) arg;
+    uthread_set_name("test-reader");
+    CHECK(uthread_rwlock_rdlock(&held) == 0);
+    uthread_rwlock_rdunlock(&held);
+    uthread_wg_done(&running);
+}
+
+// Time spent in blocking calls and waits is charged to the right
+// reason, both for the threads' name and in total.
+void test_offcpu_time()
+{
+    unsigned long long io = uthread_offcpu_time(UTHREAD_WAIT_IO, NULL);
+    CHECK(uthread_offcpu_time(UTHREAD_WAIT_REASONS, NULL) == 0);
+    CHECK(uthread_offcpu_time(UTHREAD_WAIT_IO, "test-sleeper") == 0);
+    CHECK(uthread_sem_init(&handed, 0) == 0);
+
+    uthread_wg_add(&running, SLEEPERS);
+    for (int i = 0; i < SLEEPERS; i++)
+    {
+        CHECK(uthread_spawn_task(sleeper, NULL, 1) == 0);
+    }
+
+    // Long enough for the sleepers to be parked on the semaphore
+    CHECK(uthread_run_blocking(nap, (void *) (long) SLEEP_US) == 0);
+    for (int i = 0; i < SLEEPERS; i++)
+    {
+        CHECK(uthread_sem_post(&handed) == 0);
+    }
+    uthread_wg_wait(&running);
+
+    unsigned long long named = uthread_offcpu_time(UTHREAD_WAIT_IO, "test-sleeper");
+    CHECK(named >= SLEEPERS * SLEEP_US * 1000ULL);
+    CHECK(uthread_offcpu_time(UTHREAD_WAIT_IO, NULL) - io >= named + SLEEP_US * 1000ULL);
+    CHECK(uthread_offcpu_time(UTHREAD_WAIT_SYNC, "test-sleeper") > 0);
+    CHECK(uthread_offcpu_time(UTHREAD_WAIT_MUTEX, "test-sleeper") == 0);
+
+    // A thread waiting for a lock is charged to the lock, not to the
+    // queue it waits in
+    CHECK(uthread_rwlock_init(&held) == 0);
+    CHECK(uthread_rwlock_wrlock(&held) == 0);
+    uthread_wg_add(&running, 1);
+    CHECK(uthread_spawn_task(reader, NULL, 1) == 0);
+    CHECK(uthread_run_blocking(nap, (void *) (long) SLEEP_US) == 0);
+    uthread_rwlock_wrunlock(&held);
+    uthread_wg_wait(&running);
+    uthread_rwlock_destroy(&held);
+    CHECK(uthread_offcpu_time(UTHREAD_WAIT_MUTEX, "test-reader") > 0);
+    CHECK(uthread_offcpu_time(UTHREAD_WAIT_SYNC, "test-reader") == 0);
+    printf("ok off-CPU time\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                          Stalled workers                        //
+/////////////////////////////////////////////////////////////////////
+
+
+#define QUICK_THREADS 10
+#define STALL_US 300000
+
+uthread_barrier_t stuck;
+unsigned long long stall_start;
+unsigned long long slowest_quick;
+
+void quick_thread()
+{
+    unsigned long long waited = clock_ns(CLOCK_MONOTONIC) - stall_start;
+    unsigned long long seen = __atomic_load_n(&slowest_quick, __ATOMIC_RELAXED);
+    while (waited > seen &&
+           !__atomic_compare_exchange_n(&slowest_quick, &seen, waited, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    uthread_wg_done(&running);
+}
+
+// Once every kernel thread runs one of these, queues quick threads
+// behind itself and blocks in a system call the library doesn't know.
+void blocker()
+{
+    uthread_barrier_wait(&stuck);
+    for (int i = 0; i < QUICK_THREADS; i++)
+    {
+        uthread_create(quick_thread, 5);
+    }
+    usleep(STALL_US);
+    uthread_wg_done(&running);
+}
+
+// With every kernel thread stuck in a blocking call, threads queued
+// behind them are taken over by kernel threads started in their place
+// long before the calls return.
+void test_stalled_workers()
+{
+    if (uthread_set_stall_limit(20) != 0)
+    {
+        printf("skipped stalled workers, which needs a locking build\n");
+        return;
+    }
+    CHECK(uthread_barrier_init(&stuck, workers) == 0);
+    slowest_quick = 0;
+    stall_start = clock_ns(CLOCK_MONOTONIC);
+    uthread_wg_add(&running, workers * (QUICK_THREADS + 1));
+    for (int i = 0; i < workers; i++)
+    {
+        CHECK(uthread_create(blocker, 1) == 0);
+    }
+    uthread_wg_wait(&running);
+
+    uthread_stats_t stats;
+    uthread_get_stats(&stats);
+    CHECK(stats.stalls >= 1);
+    CHECK(slowest_quick < STALL_US * 1000ULL / 2);
+    printf("ok stalled workers\n");
+}
+
+/////////////////////////////////////////////////////////////////////
+//                         Elastic workers                         //
+/////////////////////////////////////////////////////////////////////
+
+
+#define BUSY_TASKS 256
+#define BUSY_NS 2000000ULL
+
+// Keeps its kernel thread busy for a while without switching away.
+void busy_task(void *arg)
+{
+    (void) arg;
+    unsigned long long start = clock_ns(CLOCK_MONOTONIC);
+    while (clock_ns(CLOCK_MONOTONIC) - start < BUSY_NS)
+    {
+    }
+    uthread_wg_done(&running);
+}
+
+// Waits up to two seconds for kernel threads beyond those started by
+// uthread_start_workers to retire, and fills in stats.
+void settle_workers(uthread_stats_t *stats)
+{
+    uthread_get_stats(stats);
+    for (int i = 0; i < 100 && stats->workers > workers; i++)
+    {
+        CHECK(uthread_run_blocking(nap, (void *) 20000L) == 0);
+        uthread_get_stats(stats);
+    }
+}
+
+// While every kernel thread is kept busy with more waiting, more are
+// started, and once there is nothing to do they retire down to the
+// ones uthread_start_workers started.
+void test_elastic_workers()
+{
+    if (uthread_set_elastic(workers + 2, 20) != 0)
+    {
+        printf("skipped elastic workers, which needs a locking build\n");
+        return;
+    }
+
+    // Kernel threads which replaced stalled ones may not have retired
+    uthread_stats_t before;
+    settle_workers(&before);
+    CHECK(before.workers == workers);
+    uthread_wg_add(&running, BUSY_TASKS);
+    for (int i = 0; i < BUSY_TASKS; i++)
+    {
+        CHECK(uthread_spawn_task(busy_task, NULL, 1) == 0);
+    }
+    uthread_wg_wait(&running);
+
+    uthread_stats_t stats;
+    uthread_get_stats(&stats);
+    CHECK(stats.workers_started > before.workers_started);
+    CHECK(stats.peak_workers > workers);
+
+    settle_workers(&stats);
+    CHECK(stats.workers == workers);
+    CHECK(stats.workers_retired > before.workers_retired);
+    CHECK(uthread_set_elastic(workers, 20) == 0);
+    printf("ok elastic workers\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                              Driver                             //
+/////////////////////////////////////////////////////////////////////
+
+
+void run_tests()
+{
+    test_stack_painting();
+    test_stack_default_class();
+    test_shared_stack();
+    test_many_workers();
+    test_foreign_submit();
+    test_idle_workers();
+    test_runnext_steal();
+    test_blocking_calls();
+    test_offcpu_time();
+    test_stalled_workers();
+    test_elastic_workers();
+    printf("all scheduler tests passed with %d workers\n", workers);
+}
+
+int main()
+{
+    // Forks before the scheduler has any kernel threads
+    test_stack_canary();
+    test_runnext_order();
+    test_urgent_steal();
+    test_near_steal();
+
+    system_init();
+    if (uthread_start_workers(4) == 0)
+    {
+        workers = 4;
+    }
+    uthread_wg_init(&running);
+    uthread_create(run_tests, 0);
+    uthread_exit();
+}
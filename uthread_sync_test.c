@@ -0,0 +1,653 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "uthread.h"
+
+// Tests of the synchronization primitives. Build and run with
+//
+//     cc -O2 -pthread uthread.c uthread_sync_test.c && ./a.out
+//
+// and again with -DUTHREAD_LOCKING=1, which runs the same tests on
+// four kernel threads. The process exits with 1 at the first failed
+// check.
+
+
+// Stops the run if cond is false.
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+void check(int ok, const char *what, int line)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "uthread_sync_test.c:%d: check failed: %s\n", line, what);
+        exit(1);
+    }
+}
+
+// Kernel threads running user-level threads.
+int workers = 1;
+
+// Counts threads of the test running, so that it can wait for them.
+uthread_wg_t running;
+
+// Runs fn(arg) on a new kernel thread the scheduler doesn't know.
+pthread_t foreign(void *(*fn)(void *), void *arg)
+{
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, fn, arg) == 0);
+    return thread;
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                 Semaphores, latches and wait groups             //
+/////////////////////////////////////////////////////////////////////
+
+
+#define SEM_WAITERS 100
+
+uthread_sem_t sem;
+int woken_order[SEM_WAITERS];
+int woken;
+
+void sem_waiter(void *arg)
+{
+    CHECK(uthread_sem_wait(&sem) == 0);
+    woken_order[__atomic_fetch_add(&woken, 1, __ATOMIC_SEQ_CST)] = (int) (long) arg;
+    uthread_wg_done(&running);
+}
+
+// Parks waiters on a semaphore, and wakes them with posts of one and
+// of many permits. With one kernel thread they wake in the order they
+// parked.
+void test_semaphore()
+{
+    CHECK(uthread_sem_init(&sem, 0) == 0);
+    CHECK(uthread_sem_trywait(&sem) == -1);
+    woken = 0;
+    uthread_wg_add(&running, SEM_WAITERS);
+    for (long i = 0; i < SEM_WAITERS; i++)
+    {
+        CHECK(uthread_spawn_task(sem_waiter, (void *) i, 1) == 0);
+    }
+
+    // Let them all park
+    uthread_yield(2);
+    CHECK(uthread_sem_post(&sem) == 0);
+    CHECK(uthread_sem_post_n(&sem, SEM_WAITERS / 2 - 1) == 0);
+    uthread_yield(2);
+    CHECK(__atomic_load_n(&woken, __ATOMIC_SEQ_CST) <= SEM_WAITERS / 2);
+    CHECK(uthread_sem_post_n(&sem, SEM_WAITERS / 2 + 3) == 0);
+    uthread_wg_wait(&running);
+
+    CHECK(woken == SEM_WAITERS);
+    if (workers == 1)
+    {
+        for (int i = 0; i < SEM_WAITERS; i++)
+        {
+            CHECK(woken_order[i] == i);
+        }
+    }
+
+    // The permits left over stay
+    for (int i = 0; i < 3; i++)
+    {
+        CHECK(uthread_sem_trywait(&sem) == 0);
+    }
+    CHECK(uthread_sem_trywait(&sem) == -1);
+    printf("ok semaphore\n");
+}
+
+#define FOREIGN_POSTS 2000
+#define FOREIGN_TAKERS 4
+
+uthread_latch_t latch;
+uthread_wg_t foreign_wg;
+int taken;
+
+void sem_taker(void *arg)
+{
+    (void) arg;
+    for (int i = 0; i < FOREIGN_POSTS / FOREIGN_TAKERS; i++)
+    {
+        CHECK(uthread_sem_wait(&sem) == 0);
+        __atomic_add_fetch(&taken, 1, __ATOMIC_SEQ_CST);
+    }
+    uthread_wg_done(&running);
+}
+
+void latch_waiter(void *arg)
+{
+    (void) arg;
+    CHECK(uthread_latch_wait(&latch) == 0);
+    CHECK(uthread_wg_wait(&foreign_wg) == 0);
+    uthread_wg_done(&running);
+}
+
+void* poster(void *arg)
+{
+    (void) arg;
+    for (int i = 0; i < FOREIGN_POSTS; i++)
+    {
+        uthread_sem_post(&sem);
+        uthread_latch_count_down(&latch);
+        uthread_wg_done(&foreign_wg);
+        if (i % 64 == 0)
+        {
+            usleep(100);
+        }
+    }
+    return NULL;
+}
+
+// Posts a semaphore, counts down a latch and marks a wait group done
+// from a kernel thread the scheduler doesn't run on, while user-level
+// threads park and wake on them.
+void test_foreign_release()
+{
+    CHECK(uthread_sem_init(&sem, 0) == 0);
+    CHECK(uthread_latch_init(&latch, FOREIGN_POSTS) == 0);
+    uthread_wg_init(&foreign_wg);
+    CHECK(uthread_wg_add(&foreign_wg, FOREIGN_POSTS) == 0);
+    taken = 0;
+
+    uthread_wg_add(&running, FOREIGN_TAKERS + 8);
+    for (int i = 0; i < FOREIGN_TAKERS; i++)
+    {
+        CHECK(uthread_spawn_task(sem_taker, NULL, 1) == 0);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        CHECK(uthread_spawn_task(latch_waiter, NULL, 1) == 0);
+    }
+    pthread_t thread = foreign(poster, NULL);
+    uthread_wg_wait(&running);
+    pthread_join(thread, NULL);
+
+    CHECK(taken == FOREIGN_POSTS);
+    CHECK(uthread_sem_trywait(&sem) == -1);
+    CHECK(uthread_wg_done(&foreign_wg) == -1);
+    printf("ok foreign release\n");
+}
+
+#define BARRIER_THREADS 1000
+#define BARRIER_ROUNDS 3
+
+uthread_barrier_t barrier;
+int arrived[BARRIER_ROUNDS];
+int last[BARRIER_ROUNDS];
+
+void barrier_thread(void *arg)
+{
+    (void) arg;
+    for (int round = 0; round < BARRIER_ROUNDS; round++)
+    {
+        __atomic_add_fetch(&arrived[round], 1, __ATOMIC_SEQ_CST);
+        int result = uthread_barrier_wait(&barrier);
+        CHECK(result == 0 || result == 1);
+        CHECK(__atomic_load_n(&arrived[round], __ATOMIC_SEQ_CST) == BARRIER_THREADS);
+        __atomic_add_fetch(&last[round], result, __ATOMIC_SEQ_CST);
+    }
+    uthread_wg_done(&running);
+}
+
+// Nobody leaves a round of the barrier before everyone has arrived,
+// and exactly one thread a round is told it arrived last.
+void test_barrier()
+{
+    CHECK(uthread_barrier_init(&barrier, 0) == -1);
+    CHECK(uthread_barrier_init(&barrier, BARRIER_THREADS) == 0);
+    uthread_wg_add(&running, BARRIER_THREADS);
+    for (int i = 0; i < BARRIER_THREADS; i++)
+    {
+        CHECK(uthread_spawn_task(barrier_thread, NULL, 1) == 0);
+    }
+    uthread_wg_wait(&running);
+    for (int round = 0; round < BARRIER_ROUNDS; round++)
+    {
+        CHECK(last[round] == 1);
+    }
+    printf("ok barrier\n");
+}
+
+uthread_wg_t fan_out;
+int fanned;
+
+void fan_worker(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&fanned, 1, __ATOMIC_SEQ_CST);
+    uthread_yield(1);
+    uthread_wg_done(&fan_out);
+}
+
+// A latch opens once and stays open; a wait group waits for work added
+// while it is counting.
+void test_latch_and_wait_group()
+{
+    CHECK(uthread_latch_init(&latch, 0) == 0);
+    CHECK(uthread_latch_wait(&latch) == 0);
+    uthread_latch_count_down(&latch);
+    CHECK(uthread_latch_wait(&latch) == 0);
+
+    uthread_wg_init(&fan_out);
+    CHECK(uthread_wg_wait(&fan_out) == 0);
+    CHECK(uthread_wg_add(&fan_out, -1) == -1);
+    fanned = 0;
+    for (int i = 0; i < 500; i++)
+    {
+        CHECK(uthread_wg_add(&fan_out, 1) == 0);
+        CHECK(uthread_spawn_task(fan_worker, NULL, 1) == 0);
+    }
+    CHECK(uthread_wg_wait(&fan_out) == 0);
+    CHECK(fanned == 500);
+    printf("ok latch and wait group\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                      Reader-writer locks                        //
+/////////////////////////////////////////////////////////////////////
+
+
+#define READERS 500
+#define WRITERS 4
+
+uthread_rwlock_t rwlock;
+long first_half;
+long second_half;
+int writing;
+int reads;
+
+// Checks that no writer is halfway through, across switches.
+void reader(void *arg)
+{
+    (void) arg;
+    for (int i = 0; i < 200; i++)
+    {
+        CHECK(uthread_rwlock_rdlock(&rwlock) == 0);
+        CHECK(!__atomic_load_n(&writing, __ATOMIC_SEQ_CST));
+        CHECK(first_half == second_half);
+        if (i % 7 == 0)
+        {
+            uthread_yield(1);
+        }
+        CHECK(first_half == second_half);
+        __atomic_add_fetch(&reads, 1, __ATOMIC_SEQ_CST);
+        uthread_rwlock_rdunlock(&rwlock);
+        if (i % 3 == 0)
+        {
+            uthread_yield(1);
+        }
+    }
+    uthread_wg_done(&running);
+}
+
+// Updates both halves with a switch in between.
+void writer(void *arg)
+{
+    (void) arg;
+    for (int i = 0; i < 100; i++)
+    {
+        CHECK(uthread_rwlock_wrlock(&rwlock) == 0);
+        CHECK(__atomic_add_fetch(&writing, 1, __ATOMIC_SEQ_CST) == 1);
+        first_half++;
+        uthread_yield(1);
+        second_half++;
+        __atomic_sub_fetch(&writing, 1, __ATOMIC_SEQ_CST);
+        uthread_rwlock_wrunlock(&rwlock);
+        uthread_yield(1);
+    }
+    uthread_wg_done(&running);
+}
+
+// Readers share the lock and never see a writer's update half done,
+// and writers hold it alone, while hundreds of readers keep arriving.
+void test_rwlock()
+{
+    CHECK(uthread_rwlock_init(&rwlock) == 0);
+    first_half = 0;
+    second_half = 0;
+    reads = 0;
+    uthread_wg_add(&running, READERS + WRITERS);
+    for (int i = 0; i < READERS; i++)
+    {
+        CHECK(uthread_spawn_task(reader, NULL, 1) == 0);
+    }
+    for (int i = 0; i < WRITERS; i++)
+    {
+        CHECK(uthread_spawn_task(writer, NULL, 1) == 0);
+    }
+    uthread_wg_wait(&running);
+    CHECK(reads == READERS * 200);
+    CHECK(first_half == WRITERS * 100 && second_half == WRITERS * 100);
+    uthread_rwlock_destroy(&rwlock);
+    printf("ok reader-writer lock\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                Priority inheritance mutexes                     //
+/////////////////////////////////////////////////////////////////////
+
+
+uthread_mutex_t mutex;
+int pi_order[3];
+int pi_ran;
+
+// Records that the calling thread, one of 0 to 2, got this far.
+void pi_mark(int which)
+{
+    pi_order[__atomic_fetch_add(&pi_ran, 1, __ATOMIC_SEQ_CST)] = which;
+}
+
+void pi_high()
+{
+    CHECK(uthread_mutex_lock(&mutex) == 0);
+    pi_mark(0);
+    CHECK(uthread_mutex_unlock(&mutex) == 0);
+    uthread_wg_done(&running);
+}
+
+void pi_medium()
+{
+    pi_mark(1);
+    uthread_wg_done(&running);
+}
+
+// Queues behind the low priority thread, then starts the high one.
+void pi_behind()
+{
+    uthread_create(pi_high, 0);
+    uthread_yield(3);
+    uthread_wg_done(&running);
+}
+
+// Takes the mutex, then lets a medium and a high priority thread run.
+// The high one waits on the mutex and boosts us above the medium one.
+void pi_low()
+{
+    CHECK(uthread_mutex_lock(&mutex) == 0);
+    uthread_create(pi_medium, 2);
+    uthread_create_flags(pi_behind, 1, UTHREAD_SHARED_STACK);
+    uthread_yield(3);
+    pi_mark(2);
+    CHECK(uthread_mutex_unlock(&mutex) == 0);
+    uthread_wg_done(&running);
+}
+
+// A low priority thread holding a mutex a high priority one waits on
+// runs before a medium priority one, whether it has a stack of its own
+// or is pinned to its worker's shared stack. A pinned thread queued
+// behind it still runs once it has been boosted.
+void test_priority_inheritance()
+{
+    uthread_mutex_init(&mutex);
+    for (int shared = 0; shared < 2; shared++)
+    {
+        pi_ran = 0;
+        uthread_wg_add(&running, 4);
+        CHECK(uthread_create_flags(pi_low, 3, shared ? UTHREAD_SHARED_STACK : 0) == 0);
+        uthread_wg_wait(&running);
+        if (workers == 1)
+        {
+            CHECK(pi_order[0] == 2 && pi_order[1] == 0 && pi_order[2] == 1);
+        }
+    }
+    printf("ok priority inheritance\n");
+}
+
+#define CONTENDERS 16
+#define CONTENDED_ROUNDS 1000
+
+int contended_count;
+
+// Takes the mutex over and over, now and then switching away while
+// holding it so that others spin on it or park.
+void contender(void *arg)
+{
+    (void) arg;
+    for (int round = 0; round < CONTENDED_ROUNDS; round++)
+    {
+        CHECK(uthread_mutex_lock(&mutex) == 0);
+        int seen = contended_count;
+        if (round % 8 == 0)
+        {
+            uthread_yield(1);
+        }
+        contended_count = seen + 1;
+        CHECK(uthread_mutex_unlock(&mutex) == 0);
+    }
+    uthread_wg_done(&running);
+}
+
+// Keeps the mutex exclusive while threads on every kernel thread fight
+// over it, including when its holder is switched away rather than
+// running.
+void test_mutex_contention()
+{
+    uthread_mutex_init(&mutex);
+    CHECK(uthread_mutex_trylock(&mutex) == 0);
+    CHECK(uthread_mutex_trylock(&mutex) == -1);
+    CHECK(uthread_mutex_unlock(&mutex) == 0);
+
+    contended_count = 0;
+    uthread_wg_add(&running, CONTENDERS);
+    for (int i = 0; i < CONTENDERS; i++)
+    {
+        CHECK(uthread_spawn_task(contender, NULL, 1) == 0);
+    }
+    uthread_wg_wait(&running);
+    CHECK(contended_count == CONTENDERS * CONTENDED_ROUNDS);
+    printf("ok mutex contention\n");
+}
+
+#define PINNED_THREADS 64
+#define PINNED_ROUNDS 10
+
+int pinned_next;
+int pinned_count;
+
+// Holds the mutex across a yield, so that the others queue behind it
+// and boost it while it waits to run again.
+void pinned_locker()
+{
+    int i = __atomic_fetch_add(&pinned_next, 1, __ATOMIC_SEQ_CST);
+    for (int round = 0; round < PINNED_ROUNDS; round++)
+    {
+        CHECK(uthread_mutex_lock(&mutex) == 0);
+        int seen = pinned_count;
+        uthread_yield(i % 5);
+        pinned_count = seen + 1;
+        CHECK(uthread_mutex_unlock(&mutex) == 0);
+    }
+    uthread_wg_done(&running);
+}
+
+// Boosts threads pinned to a shared stack while they are queued. Each
+// has to move to its new level's queue rather than also go in it,
+// which would link it into two queues at once and lose or repeat the
+// threads after it.
+void test_pinned_boost()
+{
+    uthread_mutex_init(&mutex);
+    pinned_next = 0;
+    pinned_count = 0;
+    uthread_wg_add(&running, PINNED_THREADS);
+    for (int i = 0; i < PINNED_THREADS; i++)
+    {
+        CHECK(uthread_create_flags(pinned_locker, i % 4,
+                                   i % 3 == 0 ? UTHREAD_SHARED_STACK : 0) == 0);
+    }
+    uthread_wg_wait(&running);
+    CHECK(pinned_count == PINNED_THREADS * PINNED_ROUNDS);
+    printf("ok pinned boost\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                 Parking lot, byte locks and once                //
+/////////////////////////////////////////////////////////////////////
+
+
+#define PARKERS 20
+
+int word;
+int unparked;
+
+// Says to park while the word is still 0.
+int word_unset(void *arg)
+{
+    return __atomic_load_n((int *) arg, __ATOMIC_SEQ_CST) == 0;
+}
+
+void parker(void *arg)
+{
+    CHECK(uthread_park(arg, word_unset, arg) == 0);
+    __atomic_add_fetch(&unparked, 1, __ATOMIC_SEQ_CST);
+    uthread_wg_done(&running);
+}
+
+// Records whether more threads were parked on the address.
+void more_parked(void *arg, int more)
+{
+    *(int *) arg = more;
+}
+
+// Threads park on an address until unparked one at a time or all at
+// once, and don't park at all once the word says not to.
+void test_parking_lot()
+{
+    word = 0;
+    unparked = 0;
+    uthread_wg_add(&running, PARKERS);
+    for (int i = 0; i < PARKERS; i++)
+    {
+        CHECK(uthread_spawn_task(parker, &word, 1) == 0);
+    }
+    while (__atomic_load_n(&unparked, __ATOMIC_SEQ_CST) == 0 &&
+           uthread_unpark_one(&word, NULL, NULL) == 0)
+    {
+        uthread_yield(2);
+    }
+
+    int more = 0;
+    CHECK(uthread_unpark_one(&word, more_parked, &more) == 1);
+    if (workers == 1)
+    {
+        CHECK(more);
+    }
+    __atomic_store_n(&word, 1, __ATOMIC_SEQ_CST);
+    int left = PARKERS - 2;
+    while (left > 0)
+    {
+        left -= uthread_unpark_all(&word);
+        uthread_yield(2);
+    }
+    uthread_wg_wait(&running);
+    CHECK(unparked == PARKERS);
+    CHECK(uthread_unpark_one(&word, NULL, NULL) == 0);
+    CHECK(uthread_park(&word, word_unset, &word) == -1);
+    printf("ok parking lot\n");
+}
+
+#define BYTELOCKS 16
+#define LOCKERS 64
+
+uthread_bytelock_t bytelocks[BYTELOCKS];
+long guarded[BYTELOCKS];
+uthread_once_t once = UTHREAD_ONCE_INIT;
+int inits;
+
+// Switches away while initializing, so that others find it running.
+void init_once()
+{
+    inits++;
+    for (int i = 0; i < 5; i++)
+    {
+        uthread_yield(1);
+    }
+}
+
+void locker(void *arg)
+{
+    long id = (long) arg;
+    CHECK(uthread_once(&once, init_once) == 0);
+    CHECK(inits == 1);
+    for (int i = 0; i < 2000; i++)
+    {
+        int k = (id + i) % BYTELOCKS;
+        CHECK(uthread_bytelock_acquire(&bytelocks[k]) == 0);
+        long seen = guarded[k];
+        if (i % 3 == 0)
+        {
+            uthread_yield(1);
+        }
+        guarded[k] = seen + 1;
+        uthread_bytelock_release(&bytelocks[k]);
+    }
+    uthread_wg_done(&running);
+}
+
+// Byte locks keep what they guard consistent across switches, and a
+// once flag runs its function once, holding everyone else back until
+// it has returned.
+void test_bytelock_and_once()
+{
+    CHECK(sizeof(uthread_bytelock_t) == 1 && sizeof(uthread_once_t) == 1);
+    uthread_wg_add(&running, LOCKERS);
+    for (long i = 0; i < LOCKERS; i++)
+    {
+        CHECK(uthread_spawn_task(locker, (void *) i, 1) == 0);
+    }
+    uthread_wg_wait(&running);
+
+    long total = 0;
+    for (int i = 0; i < BYTELOCKS; i++)
+    {
+        total += guarded[i];
+    }
+    CHECK(total == LOCKERS * 2000);
+    CHECK(uthread_once(&once, init_once) == 0 && inits == 1);
+    printf("ok byte lock and once\n");
+}
+
+/////////////////////////////////////////////////////////////////////
+//                              Driver                             //
+/////////////////////////////////////////////////////////////////////
+
+
+void run_tests()
+{
+    test_semaphore();
+    test_foreign_release();
+    test_barrier();
+    test_latch_and_wait_group();
+    test_rwlock();
+    test_mutex_contention();
+    test_priority_inheritance();
+    test_pinned_boost();
+    test_parking_lot();
+    test_bytelock_and_once();
+    printf("all synchronization tests passed with %d workers\n", workers);
+}
+
+int main()
+{
+    system_init();
+    if (uthread_start_workers(4) == 0)
+    {
+        workers = 4;
+    }
+    uthread_wg_init(&running);
+    uthread_create(run_tests, 0);
+    uthread_exit();
+}
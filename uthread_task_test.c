@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "uthread.h"
+
+// Tests of what a user-level thread carries with it: thread-local
+// values, arenas, cancellation, groups and futures. Build and run with
+//
+//     cc -O2 -pthread uthread.c uthread_task_test.c && ./a.out
+//
+// and again with -DUTHREAD_LOCKING=1, which runs the same tests on
+// four kernel threads. The process exits with 1 at the first failed
+// check.
+
+
+// Stops the run if cond is false.
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+void check(int ok, const char *what, int line)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "uthread_task_test.c:%d: check failed: %s\n", line, what);
+        exit(1);
+    }
+}
+
+// Kernel threads running user-level threads.
+int workers = 1;
+
+// Counts threads of the test running, so that it can wait for them.
+uthread_wg_t running;
+
+// Runs fn(arg) on a new kernel thread the scheduler doesn't know, and
+// waits for it.
+void on_foreign(void *(*fn)(void *), void *arg)
+{
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, fn, arg) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                     Thread-local storage                        //
+/////////////////////////////////////////////////////////////////////
+
+
+#define TLS_THREADS 100
+
+uthread_key_t key;
+uthread_key_t again_key;
+int destroyed;
+int destroyed_again;
+
+void destroy(void *value)
+{
+    __atomic_add_fetch(&destroyed, 1, __ATOMIC_SEQ_CST);
+    free(value);
+}
+
+// Sets another value while being destroyed, once, which has to be
+// destroyed in turn.
+void destroy_again(void *value)
+{
+    __atomic_add_fetch(&destroyed_again, 1, __ATOMIC_SEQ_CST);
+    if (value == (void *) 1)
+    {
+        CHECK(uthread_setspecific(again_key, (void *) 2) == 0);
+    }
+}
+
+void tls_thread(void *arg)
+{
+    long *value = (long *) malloc(sizeof(long));
+    CHECK(value != NULL);
+    *value = (long) arg;
+    CHECK(uthread_getspecific(key) == NULL);
+    CHECK(uthread_setspecific(key, value) == 0);
+    CHECK(uthread_setspecific(again_key, (void *) 1) == 0);
+    for (int i = 0; i < 10; i++)
+    {
+        uthread_yield(1);
+        CHECK(uthread_getspecific(key) == value);
+    }
+    uthread_wg_done(&running);
+}
+
+// Outside a user-level thread there are no values to get or set, and
+// the calls that act on the running thread do nothing.
+void* tls_foreign(void *arg)
+{
+    (void) arg;
+    uthread_cleanup_t cleanup;
+    CHECK(uthread_getspecific(key) == NULL);
+    CHECK(uthread_setspecific(key, "foreign") == -1);
+    uthread_cleanup_push(&cleanup, destroy, NULL);
+    uthread_cleanup_pop(0);
+    uthread_set_name("foreign");
+    return NULL;
+}
+
+// Every thread sees its own value across switches, and each value is
+// destroyed when its thread exits, including ones set by destructors.
+void test_thread_local()
+{
+    CHECK(uthread_key_create(&key, destroy) == 0);
+    CHECK(uthread_key_create(&again_key, destroy_again) == 0);
+    CHECK(key != again_key);
+    CHECK(uthread_key_delete(UTHREAD_KEYS_MAX) == -1);
+
+    uthread_wg_add(&running, TLS_THREADS);
+    for (long i = 0; i < TLS_THREADS; i++)
+    {
+        CHECK(uthread_spawn_task(tls_thread, (void *) i, 1) == 0);
+    }
+    uthread_wg_wait(&running);
+
+    // The last ones may still be running their destructors
+    for (int i = 0; i < 1000000 && __atomic_load_n(&destroyed_again, __ATOMIC_SEQ_CST) <
+             2 * TLS_THREADS; i++)
+    {
+        uthread_yield(2);
+    }
+    CHECK(__atomic_load_n(&destroyed, __ATOMIC_SEQ_CST) == TLS_THREADS);
+    CHECK(__atomic_load_n(&destroyed_again, __ATOMIC_SEQ_CST) == 2 * TLS_THREADS);
+
+    on_foreign(tls_foreign, NULL);
+    CHECK(uthread_key_delete(again_key) == 0);
+    CHECK(uthread_key_delete(again_key) == -1);
+    CHECK(uthread_key_delete(key) == 0);
+    printf("ok thread-local storage\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                             Arenas                              //
+/////////////////////////////////////////////////////////////////////
+
+
+#define ARENA_THREADS 50
+#define ALLOCS 500
+
+int arena_bad;
+
+// Fills many allocations across switches and checks each kept its
+// bytes, so that arenas of different threads don't overlap.
+void arena_thread()
+{
+    unsigned char *blocks[ALLOCS];
+    for (int i = 0; i < ALLOCS; i++)
+    {
+        blocks[i] = (unsigned char *) uthread_alloc(200 + i);
+        CHECK(blocks[i] != NULL && ((unsigned long) blocks[i] & 15) == 0);
+        memset(blocks[i], i & 0xff, 200 + i);
+        if (i % 50 == 0)
+        {
+            uthread_yield(1);
+        }
+    }
+    for (int i = 0; i < ALLOCS; i++)
+    {
+        for (int j = 0; j < 200 + i; j++)
+        {
+            if (blocks[i][j] != (i & 0xff))
+            {
+                __atomic_add_fetch(&arena_bad, 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+        }
+    }
+    CHECK(uthread_alloc(1 << 20) == NULL);
+    uthread_wg_done(&running);
+    uthread_exit();
+}
+
+void no_arena_thread()
+{
+    CHECK(uthread_alloc(8) == NULL);
+    uthread_wg_done(&running);
+    uthread_exit();
+}
+
+// Threads created with UTHREAD_ARENA get aligned memory of their own
+// which outlives switches; others and oversized requests get NULL.
+void test_arenas()
+{
+    uthread_wg_add(&running, ARENA_THREADS + 1);
+    for (int i = 0; i < ARENA_THREADS; i++)
+    {
+        CHECK(uthread_create_flags(arena_thread, 1, UTHREAD_ARENA) == 0);
+    }
+    CHECK(uthread_create(no_arena_thread, 1) == 0);
+    uthread_wg_wait(&running);
+    CHECK(arena_bad == 0);
+    CHECK(uthread_alloc(8) == NULL);
+    printf("ok arenas\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                          Cancellation                           //
+/////////////////////////////////////////////////////////////////////
+
+
+uthread_sem_t never_posted;
+int cleanup_order[4];
+int cleanups;
+int ran_on;
+int never_ran;
+int started;
+
+// Records that handler arg ran, and in which order.
+void record_cleanup(void *arg)
+{
+    int n = __atomic_fetch_add(&cleanups, 1, __ATOMIC_SEQ_CST);
+    if (n < 4)
+    {
+        cleanup_order[n] = (int) (long) arg;
+    }
+}
+
+// Oldest handler of each cancelled thread: lets the test go on.
+void cancelled_done(void *arg)
+{
+    (void) arg;
+    uthread_wg_done(&running);
+}
+
+// Registers three handlers, pops a fourth, and waits on a semaphore
+// nobody posts.
+void stacked_waiter(void *arg)
+{
+    (void) arg;
+    uthread_cleanup_t done, first, second, third, popped;
+    uthread_cleanup_push(&done, cancelled_done, NULL);
+    uthread_cleanup_push(&first, record_cleanup, (void *) 1);
+    uthread_cleanup_push(&second, record_cleanup, (void *) 2);
+    uthread_cleanup_push(&popped, record_cleanup, (void *) 9);
+    uthread_cleanup_pop(0);
+    uthread_cleanup_push(&third, record_cleanup, (void *) 3);
+    __atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+    uthread_sem_wait(&never_posted);
+    __atomic_add_fetch(&ran_on, 1, __ATOMIC_SEQ_CST);
+    uthread_cleanup_pop(0);
+}
+
+// Yields until cancelled.
+void spinner(void *arg)
+{
+    (void) arg;
+    uthread_cleanup_t done;
+    uthread_cleanup_push(&done, cancelled_done, NULL);
+    __atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+    for (;;)
+    {
+        uthread_yield(1);
+    }
+}
+
+void never_runs(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&never_ran, 1, __ATOMIC_SEQ_CST);
+}
+
+void finishes(void *arg)
+{
+    (void) arg;
+    uthread_wg_done(&running);
+}
+
+void* cancel_foreign(void *arg)
+{
+    uthread_cancel((uthread_t *) arg);
+    return NULL;
+}
+
+// A cancelled thread leaves its wait without taking anything, runs
+// its handlers newest first and exits; it may be cancelled before it
+// first runs, after it has finished, or from a foreign kernel thread.
+void test_cancellation()
+{
+    CHECK(uthread_sem_init(&never_posted, 0) == 0);
+    uthread_wg_add(&running, 2);
+    uthread_t *waiter = uthread_spawn(stacked_waiter, NULL, 1);
+    uthread_t *spinning = uthread_spawn(spinner, NULL, 1);
+    CHECK(waiter != NULL && spinning != NULL);
+
+    // Cancelled before they first ran, they would have no handlers yet
+    while (__atomic_load_n(&started, __ATOMIC_SEQ_CST) < 2)
+    {
+        uthread_yield(1);
+    }
+    uthread_cancel(waiter);
+    on_foreign(cancel_foreign, spinning);
+    uthread_wg_wait(&running);
+    CHECK(cleanups == 3);
+    CHECK(cleanup_order[0] == 3 && cleanup_order[1] == 2 && cleanup_order[2] == 1);
+    uthread_sem_post(&never_posted);
+    CHECK(uthread_sem_trywait(&never_posted) == 0);
+
+    uthread_t *never = uthread_spawn(never_runs, NULL, 1);
+    CHECK(never != NULL);
+    uthread_cancel(never);
+
+    uthread_wg_add(&running, 1);
+    uthread_t *finished = uthread_spawn(finishes, NULL, 1);
+    CHECK(finished != NULL);
+    uthread_wg_wait(&running);
+    for (int i = 0; i < 5; i++)
+    {
+        uthread_yield(1);
+    }
+    uthread_cancel(finished);
+    uthread_cancel(waiter);
+    CHECK(ran_on == 0);
+
+    // Another kernel thread may start it before it is cancelled
+    if (workers == 1)
+    {
+        CHECK(never_ran == 0);
+    }
+
+    uthread_release(waiter);
+    uthread_release(spinning);
+    uthread_release(never);
+    uthread_release(finished);
+    printf("ok cancellation\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                          Task groups                            //
+/////////////////////////////////////////////////////////////////////
+
+
+#define MEMBERS 150
+#define FAILING 7
+
+uthread_sem_t gate;
+int members_ran;
+int members_through;
+
+// Counts itself and yields a few times.
+int member(void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&members_ran, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < 3; i++)
+    {
+        uthread_yield(1);
+    }
+    return 0;
+}
+
+// Fails if it is member FAILING; the others wait on a semaphore nobody
+// posts, and only get out of it by being cancelled.
+int gated_member(void *arg)
+{
+    if ((long) arg == FAILING)
+    {
+        uthread_yield(1);
+        return 42;
+    }
+    uthread_sem_wait(&gate);
+    __atomic_add_fetch(&members_through, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+// A group is waited for as a whole; the first member to fail cancels
+// the rest out of their waits, and so does cancelling the group.
+void test_groups()
+{
+    uthread_group_t group;
+    members_ran = 0;
+    for (int round = 0; round < 10; round++)
+    {
+        uthread_group_init(&group);
+        for (long i = 0; i < MEMBERS; i++)
+        {
+            CHECK(uthread_group_spawn(&group, member, (void *) i, 1) == 0);
+        }
+        CHECK(uthread_group_wait(&group) == 0);
+        uthread_group_destroy(&group);
+    }
+    CHECK(members_ran == 10 * MEMBERS);
+
+    CHECK(uthread_sem_init(&gate, 0) == 0);
+    members_through = 0;
+    uthread_group_init(&group);
+    for (long i = 0; i < MEMBERS; i++)
+    {
+        CHECK(uthread_group_spawn(&group, gated_member, (void *) i, 1) == 0);
+    }
+    CHECK(uthread_group_wait(&group) == 42);
+    uthread_group_destroy(&group);
+    CHECK(members_through == 0);
+
+    uthread_group_init(&group);
+    for (long i = 0; i < MEMBERS; i++)
+    {
+        if (i != FAILING)
+        {
+            CHECK(uthread_group_spawn(&group, gated_member, (void *) i, 1) == 0);
+        }
+    }
+    uthread_yield(2);
+    uthread_group_cancel(&group);
+    CHECK(uthread_group_spawn(&group, gated_member, (void *) 0, 1) == 0);
+    CHECK(uthread_group_wait(&group) == 0);
+    uthread_group_destroy(&group);
+    CHECK(members_through == 0);
+    printf("ok groups\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                     Futures and promises                        //
+/////////////////////////////////////////////////////////////////////
+
+
+#define FUTURES 8
+#define GETTERS 100
+
+uthread_promise_t promises[FUTURES];
+uthread_future_t *futures[FUTURES];
+long then_sum;
+int got;
+
+void add_then(void *value, void *arg)
+{
+    (void) arg;
+    __atomic_add_fetch(&then_sum, (long) value, __ATOMIC_SEQ_CST);
+    uthread_wg_done(&running);
+}
+
+void getter(void *arg)
+{
+    void *value;
+    long i = (long) arg % FUTURES;
+    CHECK(uthread_future_get(futures[i], &value) == 0);
+    CHECK((long) value == i + 1);
+    __atomic_add_fetch(&got, 1, __ATOMIC_SEQ_CST);
+    uthread_wg_done(&running);
+}
+
+// Sets the odd promises, later ones after more yields.
+void odd_setter(void *arg)
+{
+    long i = (long) arg;
+    for (int k = 0; k < i; k++)
+    {
+        uthread_yield(1);
+    }
+    CHECK(uthread_promise_set(&promises[i], (void *) (i + 1)) == 0);
+}
+
+// Sets the even promises from a kernel thread the scheduler doesn't
+// know.
+void* even_setter(void *arg)
+{
+    (void) arg;
+    for (long i = 0; i < FUTURES; i += 2)
+    {
+        CHECK(uthread_promise_set(&promises[i], (void *) (i + 1)) == 0);
+    }
+    return NULL;
+}
+
+// Threads parked on a future, continuations and the combinators all
+// see its value, whether a user-level thread or a foreign kernel
+// thread sets it, and a promise is only set once.
+void test_futures()
+{
+    long total = 0;
+    for (long i = 0; i < FUTURES; i++)
+    {
+        uthread_promise_init(&promises[i]);
+        futures[i] = uthread_promise_future(&promises[i]);
+        CHECK(!uthread_future_ready(futures[i]));
+        CHECK(uthread_future_then(futures[i], add_then, NULL, 1) == 0);
+        total += i + 1;
+    }
+    then_sum = 0;
+    got = 0;
+    uthread_wg_add(&running, FUTURES + GETTERS);
+    for (long i = 0; i < GETTERS; i++)
+    {
+        CHECK(uthread_spawn_task(getter, (void *) i, 1) == 0);
+    }
+    uthread_yield(2);
+
+    pthread_t thread;
+    CHECK(pthread_create(&thread, NULL, even_setter, NULL) == 0);
+    for (long i = 1; i < FUTURES; i += 2)
+    {
+        CHECK(uthread_spawn_task(odd_setter, (void *) i, 1) == 0);
+    }
+    int any = uthread_when_any(futures, FUTURES);
+    CHECK(any >= 0 && any < FUTURES && uthread_future_ready(futures[any]));
+    CHECK(uthread_when_all(futures, FUTURES) == 0);
+    CHECK(pthread_join(thread, NULL) == 0);
+    uthread_wg_wait(&running);
+    CHECK(got == GETTERS);
+    CHECK(then_sum == total);
+
+    // Once set, everything sees the value at once
+    uthread_wg_add(&running, FUTURES);
+    for (long i = 0; i < FUTURES; i++)
+    {
+        void *value;
+        CHECK(uthread_promise_set(&promises[i], NULL) == -1);
+        CHECK(uthread_future_get(futures[i], &value) == 0 && (long) value == i + 1);
+        CHECK(uthread_future_then(futures[i], add_then, NULL, 1) == 0);
+    }
+    CHECK(uthread_when_any(futures + 2, 3) == 0);
+    uthread_wg_wait(&running);
+    CHECK(then_sum == 2 * total);
+    printf("ok futures\n");
+}
+
+
+/////////////////////////////////////////////////////////////////////
+//                              Driver                             //
+/////////////////////////////////////////////////////////////////////
+
+
+void run_tests()
+{
+    test_thread_local();
+    test_arenas();
+    test_cancellation();
+    test_groups();
+    test_futures();
+    printf("all task tests passed with %d workers\n", workers);
+}
+
+int main()
+{
+    system_init();
+    if (uthread_start_workers(4) == 0)
+    {
+        workers = 4;
+    }
+    uthread_wg_init(&running);
+    uthread_create(run_tests, 0);
+    uthread_exit();
+}